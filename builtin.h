@@ -0,0 +1,3 @@
+/* the builtin font; generated with "make font FONT=/path/to/font" */
+#define BUILTIN		NULL
+#define BUILTIN_ID	0
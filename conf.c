@@ -2,10 +2,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include "fbpad.h"
 
-static char tags[32] = "xnlhtr01234uiva ";
-static char saved[32];
+static char tags[256] = "xnlhtr01234uiva ";
+static char saved[256];
 static char fonts[3][512];
 static int clrfg = 0x000000;
 static int clrbg = 0xffffff;
@@ -16,8 +18,15 @@ static int borderwd = 2;
 static char term[128] = "linux";
 static char pass[128];
 static char scrshot[128] = "/tmp/scr";
+static char gcache[512];
+static char fall_buf[2048];
+static char *fall_list[FN_NFALL + 1];
 static char quitkey;
 static int brighten = 1;
+static int hiderate;
+static int autoreload;
+static int scrmem = 4096;
+static int memlimit;
 static char cmd_buf[4096];
 static int cmd_pos;
 static char *cmd_list[128][8] = {
@@ -47,22 +56,48 @@ static void cmd_read(int c, char *src)
 	}
 }
 
-/* load .fbpad; returns -1 for failure, 1 if fonts are updated */
+static void fall_read(char *src)
+{
+	int n = 0;
+	char *s;
+	memset(fall_buf, 0, sizeof(fall_buf));
+	strcpy(fall_buf, src);
+	memset(fall_list, 0, sizeof(fall_list));
+	for (s = strtok(fall_buf, " \t\n"); s && n < LEN(fall_list) - 1; s = strtok(NULL, " \t\n"))
+		fall_list[n++] = s;
+}
+
+static char *conf_path(void)
+{
+	static char path[512];
+	snprintf(path, sizeof(path), "%s/.fbpad", getenv("HOME") ? getenv("HOME") : "");
+	return path;
+}
+
+/* load .fbpad; returns -1 for failure, or the changes (CF_*) */
 int conf_read(void)
 {
-	char path[512];
+	char ofonts[LEN(fonts)][LEN(fonts[0])];
+	char ofall[LEN(fall_buf)];
+	char otags[LEN(tags)];
+	unsigned oclr16[LEN(clr16)];
+	int oclr[] = {clrfg, clrbg, cursorfg, cursorbg, borderfg, borderwd, brighten};
 	char t[256];
-	int fnup = 0;
+	int chg = 0;
+	int i;
 	FILE *fp;
-	snprintf(path, sizeof(path), "%s/.fbpad", getenv("HOME") ? getenv("HOME") : "");
-	if (!(fp = fopen(path, "r")))
+	if (!(fp = fopen(conf_path(), "r")))
 		return -1;
+	memcpy(ofonts, fonts, sizeof(fonts));
+	memcpy(ofall, fall_buf, sizeof(fall_buf));
+	memcpy(otags, tags, sizeof(tags));
+	memcpy(oclr16, clr16, sizeof(clr16));
 	while (fscanf(fp, "%31s", t) == 1) {
 		if (!strcmp("tags", t)) {
-			fscanf(fp, "%30s", tags);
+			fscanf(fp, "%254s", tags);
 			strcpy(strchr(tags, '\0'), " ");
 		} else if (!strcmp("saved", t)) {
-			fscanf(fp, "%31s", saved);
+			fscanf(fp, "%255s", saved);
 		} else if (!strcmp("color", t)) {
 			fscanf(fp, "%x %x", &clrfg, &clrbg);
 		} else if (!strcmp("color16", t)) {
@@ -70,10 +105,12 @@ int conf_read(void)
 			for (i = 0; i < 16; i++)
 				fscanf(fp, "%x", &clr16[i]);
 		} else if (!strcmp("font", t)) {
-			char fr[256], fi[256], fb[256];
-			if (fscanf(fp, "%511s %511s %511s", fonts[0], fonts[1], fonts[2]) == 3)
-				pad_init(fr, fi, fb);
-			fnup = 1;
+			fscanf(fp, "%511s %511s %511s", fonts[0], fonts[1], fonts[2]);
+		} else if (!strcmp("fallback", t)) {
+			char fall[2048];
+			if (fgets(fall, sizeof(fall), fp))
+				fall_read(fall);
+			continue;
 		} else if (!strcmp("cursor", t)) {
 			fscanf(fp, "%x %x", &cursorfg, &cursorbg);
 		} else if (!strcmp("border", t)) {
@@ -82,12 +119,22 @@ int conf_read(void)
 			fscanf(fp, "%127s", term);
 		} else if (!strcmp("scrshot", t)) {
 			fscanf(fp, "%127s", scrshot);
+		} else if (!strcmp("gcache", t)) {
+			fscanf(fp, "%511s", gcache);
 		} else if (!strcmp("pass", t)) {
 			fscanf(fp, "%127s", pass);
 		} else if (!strcmp("quitkey", t)) {
 			fscanf(fp, " %c", &quitkey);
 		} else if (!strcmp("brighten", t)) {
 			fscanf(fp, "%d", &brighten);
+		} else if (!strcmp("hiderate", t)) {
+			fscanf(fp, "%d", &hiderate);
+		} else if (!strcmp("scrmem", t)) {
+			fscanf(fp, "%d", &scrmem);
+		} else if (!strcmp("memlimit", t)) {
+			fscanf(fp, "%d", &memlimit);
+		} else if (!strcmp("autoreload", t)) {
+			fscanf(fp, "%d", &autoreload);
 		} else if (!strcmp("command", t)) {
 			char key;
 			char cmd[512];
@@ -99,7 +146,52 @@ int conf_read(void)
 		}
 		fgets(t, sizeof(t), fp);
 	}
-	return fnup;
+	fclose(fp);
+	for (i = 0; i < LEN(fonts); i++)
+		if (strcmp(ofonts[i], fonts[i]))
+			chg |= CF_FONT << i;
+	if (memcmp(ofall, fall_buf, sizeof(fall_buf)))
+		chg |= CF_FALL;
+	if (strcmp(otags, tags))
+		chg |= CF_TAGS;
+	if (memcmp(oclr16, clr16, sizeof(clr16)) || oclr[0] != clrfg ||
+			oclr[1] != clrbg || oclr[2] != cursorfg || oclr[3] != cursorbg ||
+			oclr[4] != borderfg || oclr[5] != borderwd || oclr[6] != brighten)
+		chg |= CF_CLR;
+	return chg;
+}
+
+/* watch .fbpad for modifications if autoreload is set; returns an inotify fd */
+int conf_watch(void)
+{
+	char dir[512];
+	int fd;
+	snprintf(dir, sizeof(dir), "%s/", getenv("HOME") ? getenv("HOME") : "");
+	if (!autoreload || (fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+	/* the directory is watched, since editors may replace the file */
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* read the events of conf_watch(); returns nonzero if .fbpad was modified */
+int conf_changed(int fd)
+{
+	char buf[4096];
+	struct inotify_event *ev;
+	int chg = 0;
+	int i, n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i + sizeof(*ev) <= n; i += sizeof(*ev) + ev->len) {
+			ev = (void *) (buf + i);
+			if (ev->len && !strcmp(".fbpad", ev->name))
+				chg = 1;
+		}
+	}
+	return chg;
 }
 
 char **conf_command(int c)
@@ -157,6 +249,11 @@ char *conf_scrshot(void)
 	return scrshot;
 }
 
+char *conf_gcache(void)
+{
+	return gcache;
+}
+
 char *conf_term(void)
 {
 	return term;
@@ -167,6 +264,11 @@ char *conf_font(int i)
 	return i >= 0 && i < 3 ? fonts[i] : "";
 }
 
+char **conf_fallback(void)
+{
+	return fall_list;
+}
+
 char *conf_pass(void)
 {
 	return pass;
@@ -181,3 +283,18 @@ int conf_brighten(void)
 {
 	return brighten;
 }
+
+int conf_hiderate(void)
+{
+	return hiderate;
+}
+
+int conf_scrmem(void)
+{
+	return scrmem;
+}
+
+int conf_memlimit(void)
+{
+	return memlimit;
+}
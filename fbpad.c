@@ -26,6 +26,7 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/vt.h>
 #include "fbpad.h"
@@ -33,14 +34,34 @@
 
 #define CTRLKEY(x)	((x) - 96)
 #define POLLFLAGS	(POLLIN | POLLHUP | POLLERR | POLLNVAL)
-#define NTAGS		32
-#define NTERMS		(NTAGS * 2)
+#define TAG(i)		((i) / 2)	/* the tag of terminal i */
 #define TERMOPEN(i)	(terms[i] && term_fd(terms[i]))
+#define QUANTUM		(1 << 13)	/* bytes read from each terminal per round */
+#define SLICE		100		/* hidden terminal allowance period (ms) */
+#define WARMCNT		256		/* cells prerendered in each idle step */
 
-static struct term *terms[NTERMS];
-static int tops[NTAGS];		/* top terms of tags */
-static int split[NTAGS];	/* terms are shown together */
-static int saved[NTAGS];	/* saved tags */
+/* terminals 2n and 2n + 1 belong to tag n; the arrays grow with tags */
+static struct term **terms;
+static int *deficit;		/* deficit round-robin counters */
+static int *hidused;		/* bytes read from hidden terms in this slice */
+static int *tops;		/* top terms of tags */
+static int *split;		/* terms are shown together */
+static int *saved;		/* saved tags */
+static int ntags;		/* the number of allocated tags */
+static int tagidx[256];		/* tag index of each tag character plus one */
+static int *opened;		/* open terminals in increasing order */
+static int nopened;
+static struct pollfd *ufds;	/* poll() array of pollterms() */
+static int *ufds_term;		/* the terminal of each entry of ufds[] */
+static int rrnext;		/* rotates the terminal served first */
+static unsigned hidslice;	/* the beginning of the current slice */
+static int warm = -1;		/* glyph cache prewarming step or -1 */
+static int warmpos;		/* the next cell of the prewarmed terminal */
+static int gcshrunk;		/* the glyph cache was shrunk for memlimit */
+static int confd = -1;		/* inotify fd watching .fbpad or -1 */
+static int scrfb = -1;		/* the snapshot matching the framebuffer or -1 */
+static int *snapped;		/* hidden terms whose screen is in their snapshot */
+static int overlay;		/* the tag list is drawn over the screen */
 static int ctag;		/* current tag */
 static int ltag;		/* last tag */
 static int exitit;		/* exit fbpad if set */
@@ -55,31 +76,85 @@ static int cmdmode;		/* execute a command and exit */
 /* the current terminal */
 static int cterm(void)
 {
-	return tops[ctag] ? NTAGS + ctag : ctag;
+	return ctag * 2 + tops[ctag];
 }
 
 /* tag's active terminal */
 static int tterm(int n)
 {
-	return tops[n] ? NTAGS + n : n;
+	return n * 2 + tops[n];
 }
 
 /* the other terminal in the same tag */
 static int aterm(int n)
 {
-	return n < NTAGS ? n + NTAGS : n - NTAGS;
+	return n ^ 1;
 }
 
 /* the next terminal */
 static int nterm(void)
 {
-	int n = (cterm() + 1) % NTERMS;
-	while (n != cterm()) {
-		if (TERMOPEN(n))
-			break;
-		n = (n + 1) % NTERMS;
+	int i;
+	for (i = 0; i < nopened; i++)
+		if (opened[i] > cterm())
+			return opened[i];
+	return nopened ? opened[0] : cterm();
+}
+
+/* grow array *a from on to nn zero-initialized items of size sz */
+static int t_grow(void *a, int on, int nn, int sz)
+{
+	char *b = realloc(*(void **) a, nn * sz);
+	if (!b)
+		return 1;
+	memset(b + on * sz, 0, (nn - on) * sz);
+	*(void **) a = b;
+	return 0;
+}
+
+/* allocate the tags in conf_tags() */
+static int t_tags(void)
+{
+	char *tags = conf_tags();
+	int n = strlen(tags);
+	int o = ntags;
+	int i;
+	if (n > o) {
+		if (t_grow(&terms, o * 2, n * 2, sizeof(terms[0])) ||
+				t_grow(&deficit, o * 2, n * 2, sizeof(deficit[0])) ||
+				t_grow(&hidused, o * 2, n * 2, sizeof(hidused[0])) ||
+				t_grow(&snapped, o * 2, n * 2, sizeof(snapped[0])) ||
+				t_grow(&opened, o * 2, n * 2, sizeof(opened[0])) ||
+				t_grow(&ufds, o * 2 + 2, n * 2 + 2, sizeof(ufds[0])) ||
+				t_grow(&ufds_term, o * 2 + 1, n * 2 + 1, sizeof(ufds_term[0])) ||
+				t_grow(&tops, o, n, sizeof(tops[0])) ||
+				t_grow(&split, o, n, sizeof(split[0])) ||
+				t_grow(&saved, o, n, sizeof(saved[0])))
+			return 1;
+		ntags = n;
+	}
+	memset(tagidx, 0, sizeof(tagidx));
+	for (i = n - 1; i >= 0; i--)
+		tagidx[(unsigned char) tags[i]] = i + 1;
+	return 0;
+}
+
+/* update the list of open terminals */
+static void t_opened(int idx)
+{
+	int i = 0, j;
+	while (i < nopened && opened[i] < idx)
+		i++;
+	if (i < nopened && opened[i] == idx && !TERMOPEN(idx)) {
+		memmove(opened + i, opened + i + 1, (nopened - i - 1) * sizeof(opened[0]));
+		nopened--;
+	}
+	if ((i == nopened || opened[i] != idx) && TERMOPEN(idx)) {
+		for (j = nopened; j > i; j--)
+			opened[j] = opened[j - 1];
+		opened[i] = idx;
+		nopened++;
 	}
-	return n;
 }
 
 static void t_conf(int idx)
@@ -89,8 +164,8 @@ static void t_conf(int idx)
 	int h2 = fb_rows() - h1 - 4 * brwid;
 	int w1 = fb_cols() / 2 / pad_ccols() * pad_ccols();
 	int w2 = fb_cols() - w1 - 4 * brwid;
-	int tag = idx % NTAGS;
-	int top = idx < NTAGS;
+	int tag = TAG(idx);
+	int top = !(idx & 1);
 	if (split[tag] == 0)
 		pad_conf(0, 0, fb_rows(), fb_cols());
 	if (split[tag] == 1)
@@ -105,8 +180,13 @@ static void t_hide(int idx, int save)
 {
 	if (save && TERMOPEN(idx))
 		term_hide(terms[idx]);
-	if (save && saved[idx % NTAGS] && TERMOPEN(idx))
-		scr_snap(idx);
+	/* the screens of other terminals are kept in a memory-limited pool */
+	if (save && TERMOPEN(idx) && (saved[TAG(idx)] ||
+			(conf_scrmem() > 0 && !split[TAG(idx)] && !overlay))) {
+		scr_snap(idx, saved[TAG(idx)]);
+		snapped[idx] = 1;
+		scrfb = idx;
+	}
 	if (terms[idx])
 		term_save(terms[idx]);
 }
@@ -116,8 +196,15 @@ static int t_show(int idx, int show)
 {
 	t_conf(idx);
 	term_load(terms[idx], show > 0);
-	if (show == 2)	/* redraw if scr_load() fails */
-		show += !TERMOPEN(idx) || !saved[idx % NTAGS] || scr_load(idx);
+	/* redraw if scr_load() fails or the screen has changed since scr_snap() */
+	if (show == 2)
+		show += !TERMOPEN(idx) || (!saved[TAG(idx)] && !snapped[idx]) ||
+			scr_load(idx, scrfb);
+	scrfb = -1;
+	if (show > 0)
+		snapped[idx] = 0;
+	if (show >= 2)
+		overlay = 0;
 	if (show > 0)
 		term_redraw(show == 3);
 	if ((show == 2 || show == 3) && TERMOPEN(idx))
@@ -131,8 +218,8 @@ static int t_show(int idx, int show)
 /* + perm: whether it is a permanent switch */
 static int t_hideshow(int oidx, int save, int nidx, int show, int perm)
 {
-	int otag = oidx % NTAGS;
-	int ntag = nidx % NTAGS;
+	int otag = TAG(oidx);
+	int ntag = TAG(nidx);
 	int ret;
 	t_hide(oidx, save);
 	if (show && split[otag] && otag == ntag && perm)
@@ -148,24 +235,24 @@ static void t_set(int n)
 {
 	if (cterm() == n || cmdmode)
 		return;
-	if (taglock && ctag != n % NTAGS)
+	if (taglock && ctag != TAG(n))
 		return;
-	if (ctag != n % NTAGS)
+	if (ctag != TAG(n))
 		ltag = ctag;
-	if (ctag == n % NTAGS) {
-		if (split[n % NTAGS])
+	if (ctag == TAG(n)) {
+		if (split[TAG(n)])
 			t_hideshow(cterm(), 0, n, 1, 1);
 		else
 			t_hideshow(cterm(), 1, n, 2, 1);
 	} else {
 		int draw = t_hideshow(cterm(), 1, n, 2, 1);
-		if (split[n % NTAGS]) {
+		if (split[TAG(n)]) {
 			t_hideshow(n, 0, aterm(n), draw == 2 ? 1 : 2, 0);
 			t_hideshow(aterm(n), 0, n, 1, 1);
 		}
 	}
-	ctag = n >= NTAGS ? n - NTAGS : n;
-	tops[ctag] = n >= NTAGS;
+	ctag = TAG(n);
+	tops[ctag] = n & 1;
 }
 
 static void t_split(int n)
@@ -182,6 +269,83 @@ static void t_exec(char **args, int swsig)
 		term_load(terms[cterm()], 1);
 	}
 	term_exec(args, swsig);
+	t_opened(cterm());
+}
+
+/* prewarm the glyph cache when idle */
+static void t_warmup(void)
+{
+	warm = 0;
+	warmpos = 0;
+}
+
+/* fill the glyph cache with visible glyphs of open terminals and ASCII characters */
+static void t_warm(void)
+{
+	int c, fg;
+	if (warm < 0)
+		return;
+	if (warm < nopened) {
+		warmpos = term_warm(terms[opened[warm]], warmpos, WARMCNT);
+		if (warmpos < 0) {
+			warm++;
+			warmpos = 0;
+		}
+		return;
+	}
+	if (warm - nopened > 16) {
+		warm = -1;
+		return;
+	}
+	fg = warm > nopened ? conf_clr16()[warm - nopened - 1] : conf_fg();
+	for (c = '!'; c <= '~'; c++)
+		pad_warm(c, fg, conf_bg());
+	warm++;
+}
+
+/* apply the changes returned by conf_read() */
+static void t_reload(int chg)
+{
+	int i;
+	if (chg < 0)
+		return;
+	if (chg & CF_FONT) {
+		if (pad_init(conf_font(0), conf_font(1), conf_font(2)))
+			chg &= ~CF_FONTS;
+	} else {
+		if (chg & (CF_FONT << 1))
+			pad_face(1, conf_font(1));
+		if (chg & (CF_FONT << 2))
+			pad_face(2, conf_font(2));
+	}
+	if (chg & CF_FALL)
+		pad_fallback(conf_fallback());
+	if (chg & (CF_FONTS | CF_FALL))
+		pad_gcload(conf_gcache());
+	if (chg & CF_CLR)
+		term_colors();
+	scr_limit(conf_scrmem() * 1024l);
+	t_tags();
+	/* cached glyphs are keyed on RGB colours and remain valid */
+	if (chg & (CF_FONTS | CF_FALL | CF_CLR)) {
+		for (i = 0; i < ntags * 2; i++)
+			if (!saved[TAG(i)])
+				scr_free(i);
+	}
+	if (chg & (CF_FONTS | CF_FALL | CF_CLR) && !hidden) {
+		term_redraw(1);
+		t_warmup();
+	}
+}
+
+/* memory used by terminals, saved screens and the glyph cache */
+static long t_memuse(void)
+{
+	long mem = pad_mem() + scr_mem(1) + term_spare(0) + img_mem();
+	int i;
+	for (i = 0; i < nopened; i++)
+		mem += term_mem(terms[opened[i]]);
+	return mem;
 }
 
 static void listtags(void)
@@ -192,18 +356,20 @@ static void listtags(void)
 	int colors[] = {0x173f4f, fg, 0x68cbc0 | FN_B};
 	int c = 0;
 	int r = pad_rows() - 1;
+	char mem[64];
 	int i;
+	overlay = 1;
 	pad_put('T', r, c++, fg | FN_B, bg);
 	pad_put('A', r, c++, fg | FN_B, bg);
 	pad_put('G', r, c++, fg | FN_B, bg);
 	pad_put('S', r, c++, fg | FN_B, bg);
 	pad_put(':', r, c++, fg | FN_B, bg);
 	pad_put(' ', r, c++, fg | FN_B, bg);
-	for (i = 0; i < NTAGS && c + 2 < pad_cols(); i++) {
+	for (i = 0; tags[i] && c + 2 < pad_cols(); i++) {
 		int nt = 0;
-		if (TERMOPEN(i))
+		if (TERMOPEN(i * 2))
 			nt++;
-		if (TERMOPEN(aterm(i)))
+		if (TERMOPEN(i * 2 + 1))
 			nt++;
 		pad_put(i == ctag ? '(' : ' ', r, c++, fg, bg);
 		if (saved[i])
@@ -214,11 +380,17 @@ static void listtags(void)
 	}
 	for (; c < pad_cols(); c++)
 		pad_put(' ', r, c, fg, bg);
+	if (conf_memlimit() > 0)
+		snprintf(mem, sizeof(mem), "%ldK/%dK", t_memuse() >> 10, conf_memlimit());
+	else
+		snprintf(mem, sizeof(mem), "%ldK", t_memuse() >> 10);
+	c = pad_cols() - strlen(mem) - 1;
+	for (i = 0; mem[i] && c + i > 0; i++)
+		pad_put(mem[i], r, c + i, fg, bg);
 }
 
 static void directkey(void)
 {
-	char *tags = conf_tags();
 	char user[16];
 	int n = read(0, user, sizeof(user));
 	int c = (unsigned char) user[0];
@@ -250,8 +422,8 @@ static void directkey(void)
 		switch (c) {
 		case 'e':
 			saved[ctag] = 0;
-			scr_free(ctag);
-			scr_free(aterm(ctag));
+			scr_free(ctag * 2);
+			scr_free(ctag * 2 + 1);
 			return;
 		case 'j':
 		case 'k':
@@ -284,9 +456,7 @@ static void directkey(void)
 			term_redraw(1);
 			return;
 		case CTRLKEY('e'):
-			if (conf_read() > 0)
-				pad_init(conf_font(0), conf_font(1), conf_font(2));
-			term_redraw(1);
+			t_reload(conf_read());
 			return;
 		case CTRLKEY('l'):
 			locked = 1;
@@ -308,8 +478,8 @@ static void directkey(void)
 			t_split(0);
 			return;
 		default:
-			if (strchr(tags, c)) {
-				t_set(tterm(strchr(tags, c) - tags));
+			if (tagidx[c]) {
+				t_set(tterm(tagidx[c] - 1));
 				return;
 			}
 		}
@@ -319,7 +489,7 @@ static void directkey(void)
 
 static void peepterm(int termid)
 {
-	int visible = !hidden && ctag == (termid % NTAGS) && split[ctag];
+	int visible = !hidden && ctag == TAG(termid) && split[ctag];
 	if (termid != cterm())
 		t_hideshow(cterm(), 0, termid, visible, 0);
 }
@@ -330,41 +500,188 @@ static void peepback(int termid)
 		t_hideshow(termid, 0, cterm(), !hidden, 1);
 }
 
-static int pollterms(void)
+/* milliseconds since an arbitrary point */
+static unsigned mstime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* whether idx is drawn on the screen */
+static int t_visible(int idx)
+{
+	return !hidden && (idx == cterm() || (split[ctag] && idx == aterm(cterm())));
+}
+
+/* draw visible terminals whose synchronized output has timed out */
+static void t_synced(void)
 {
-	struct pollfd ufds[NTERMS + 1];
-	int term_idx[NTERMS + 1];
 	int i;
+	for (i = 0; i < nopened; i++) {
+		if (t_visible(opened[i]) && !term_sync(terms[opened[i]])) {
+			peepterm(opened[i]);
+			term_redraw(0);
+			peepback(opened[i]);
+		}
+	}
+}
+
+/* free memory beyond memlimit: spare arenas, unpinned screens, images, glyph cache, and history */
+static void t_memlimit(void)
+{
+	long lim = conf_memlimit() * 1024l;
+	long over, mem;
+	int i;
+	if (lim <= 0) {
+		if (gcshrunk && pad_grow())
+			gcshrunk = 0;
+		return;
+	}
+	over = t_memuse() - lim;
+	if (over <= 0) {
+		/* regrow the glyph cache shrunk by a memory spike, if it fits */
+		if (gcshrunk && over + pad_mem() <= 0 && pad_grow())
+			gcshrunk = 0;
+		return;
+	}
+	/* the usage is computed once; each step subtracts what it frees */
+	over -= term_spare(0);
+	term_spare(1);
+	mem = scr_mem(0);
+	scr_limit(MAX(0, mem - over));
+	scr_limit(conf_scrmem() * 1024l);
+	over -= mem - scr_mem(0);
+	if (over > 0) {
+		mem = img_mem();
+		img_evict(MAX(0, mem - over));
+		over -= mem - img_mem();
+	}
+	while (over > 0) {
+		mem = pad_mem();
+		if (pad_shrink())
+			break;
+		over -= mem - pad_mem();
+		gcshrunk = 1;
+	}
+	for (i = 0; i < nopened && over > 0; i++) {
+		if (!t_visible(opened[i])) {
+			mem = term_mem(terms[opened[i]]);
+			term_trim(terms[opened[i]]);
+			over -= mem - term_mem(terms[opened[i]]);
+		}
+	}
+}
+
+/* bytes that may be read from terminal idx in this slice */
+static int t_allowance(int idx)
+{
+	int rate = conf_hiderate() * 1024 / (1000 / SLICE);
+	if (conf_hiderate() <= 0 || t_visible(idx))
+		return QUANTUM;
+	return MAX(0, rate - hidused[idx]);
+}
+
+/* handle the keys pressed while reading terminals */
+static void pollkeys(void)
+{
+	struct pollfd ufds[1];
+	ufds[0].fd = 0;
+	ufds[0].events = POLLIN;
+	if (poll(ufds, 1, 0) > 0 && ufds[0].revents & POLLIN)
+		directkey();
+}
+
+static int pollterms(void)
+{
+	int i, j;
 	int n = 1;
+	int timeout = 1000;
+	if (mstime() - hidslice >= SLICE) {
+		hidslice = mstime();
+		for (j = 0; j < nopened; j++)
+			hidused[opened[j]] = 0;
+	}
 	ufds[0].fd = 0;
 	ufds[0].events = POLLIN;
-	for (i = 0; i < NTERMS; i++) {
-		if (TERMOPEN(i)) {
-			ufds[n].fd = term_fd(terms[i]);
-			ufds[n].events = POLLIN;
-			term_idx[n++] = i;
-		}
+	for (j = 0; j < nopened; j++) {
+		i = opened[j];
+		ufds[n].fd = term_fd(terms[i]);
+		ufds[n].events = 0;
+		/* throttled terminals are not read until the next slice */
+		if (t_allowance(i))
+			ufds[n].events |= POLLIN;
+		else
+			timeout = MIN(timeout, SLICE - (int) (mstime() - hidslice));
+		if (term_sendq(terms[i]))
+			ufds[n].events |= POLLOUT;
+		if (t_visible(i) && term_sync(terms[i]) >= 0)
+			timeout = MIN(timeout, term_sync(terms[i]));
+		ufds_term[n++] = i;
 	}
-	if (poll(ufds, n, 1000) < 1)
+	if (confd >= 0) {
+		ufds[n].fd = confd;
+		ufds[n].events = POLLIN;
+	}
+	if (warm >= 0)
+		timeout = 0;
+	if (poll(ufds, n + (confd >= 0), MAX(0, timeout)) < 1) {
+		t_synced();
+		t_warm();
 		return 0;
+	}
 	if (ufds[0].revents & (POLLFLAGS & ~POLLIN))
 		return 1;
 	if (ufds[0].revents & POLLIN)
 		directkey();
-	for (i = 1; i < n; i++) {
+	if (confd >= 0 && ufds[n].revents & POLLIN && conf_changed(confd))
+		t_reload(conf_read());
+	/* deficit round-robin: each ready terminal gets QUANTUM bytes per round */
+	/* + ufds_term[] is not cached; directkey() and t_reload() may grow it */
+	rrnext++;
+	for (j = 1; j < n; j++) {
+		int idx, nr;
+		i = 1 + (j + rrnext) % (n - 1);
+		idx = ufds_term[i];
+		if (ufds[i].revents & POLLOUT)
+			term_flush(terms[idx]);
 		if (!(ufds[i].revents & POLLFLAGS))
 			continue;
-		peepterm(term_idx[i]);
 		if (ufds[i].revents & POLLIN) {
-			term_read();
+			if (!t_allowance(idx))
+				continue;
+			deficit[idx] += QUANTUM;
+			if (deficit[idx] <= 0)
+				continue;
+			peepterm(idx);
+			nr = term_read(MIN(deficit[idx], t_allowance(idx)));
+			if (!t_visible(idx))
+				hidused[idx] += nr;
+			/* an idle terminal does not keep its unused quantum */
+			deficit[idx] = nr < deficit[idx] ? 0 : deficit[idx] - nr;
+		} else if (ioctl(ufds[i].fd, FIONREAD, &nr) == 0 && nr > 0) {
+			/* the last output of an exited program, even if throttled */
+			peepterm(idx);
+			term_read(QUANTUM);
 		} else {
-			scr_free(term_idx[i]);
+			peepterm(idx);
+			deficit[idx] = 0;
+			hidused[idx] = 0;
+			scr_free(idx);
 			term_end();
+			/* closed terminals cost nothing until executed again */
+			term_free(terms[idx]);
+			terms[idx] = NULL;
+			term_load(NULL, 0);
+			t_opened(idx);
 			if (cmdmode)
 				exitit = 1;
 		}
-		peepback(term_idx[i]);
+		peepback(idx);
+		pollkeys();
 	}
+	t_synced();
+	t_memlimit();
 	return 0;
 }
 
@@ -377,6 +694,7 @@ static void mainloop(char **args)
 	tcsetattr(0, TCSAFLUSH, &termios);
 	term_load(terms[cterm()], 1);
 	term_redraw(1);
+	t_warmup();
 	if (args) {
 		cmdmode = 1;
 		t_exec(args, 0);
@@ -395,6 +713,7 @@ static void signalreceived(int n)
 	case SIGUSR1:
 		hidden = 1;
 		t_hide(cterm(), 1);
+		scrfb = -1;
 		fb_leave();
 		ioctl(0, VT_RELDISP, 1);
 		break;
@@ -428,6 +747,17 @@ static void signalsetup(void)
 	ioctl(0, VT_SETMODE, &vtm);
 }
 
+/* save the glyph cache, with the default colours prerendered */
+static void gcsave(void)
+{
+	int fg[17];
+	int i;
+	fg[0] = conf_fg();
+	for (i = 0; i < 16; i++)
+		fg[i + 1] = conf_clr16()[i];
+	pad_gcsave(conf_gcache(), fg, LEN(fg), conf_bg());
+}
+
 int main(int argc, char **argv)
 {
 	char *hide = "\x1b[2J\x1b[H\x1b[?25l";
@@ -435,28 +765,41 @@ int main(int argc, char **argv)
 	char **args = argv + 1;
 	int i;
 	conf_read();
+	term_colors();
+	confd = conf_watch();
+	scr_limit(conf_scrmem() * 1024l);
+	if (t_tags()) {
+		fprintf(stderr, "fbpad: cannot allocate tags\n");
+		return 1;
+	}
 	if (fb_init(getenv("FBDEV"))) {
 		fprintf(stderr, "fbpad: failed to initialize the framebuffer\n");
 		return 1;
 	}
-	if (pad_init(conf_font(0), conf_font(1), conf_font(2))) {
+	if (pad_init(conf_font(0), conf_font(1), conf_font(2)) &&
+			pad_init("builtin", conf_font(1), conf_font(2))) {
 		fprintf(stderr, "fbpad: cannot find fonts\n");
 		return 1;
 	}
+	pad_fallback(conf_fallback());
+	pad_gcload(conf_gcache());
 	write(1, hide, strlen(hide));
 	signalsetup();
 	fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
 	while (args[0] && args[0][0] == '-')
 		args++;
 	for (i = 0; conf_tags()[i]; i++)
-		saved[i] = strchr(conf_saved(), conf_tags()[i % NTAGS]) != NULL;
+		saved[i] = strchr(conf_saved(), conf_tags()[i]) != NULL;
 	mainloop(args[0] ? args : NULL);
 	write(1, show, strlen(show));
-	for (i = 0; i < NTERMS; i++)
+	for (i = 0; i < ntags * 2; i++)
 		if (terms[i])
 			term_free(terms[i]);
+	gcsave();
+	term_spare(1);
 	pad_free();
 	scr_done();
+	img_done();
 	fb_free();
 	return 0;
 }
@@ -19,31 +19,50 @@ void term_free(struct term *term);
 void term_load(struct term *term, int visible);
 void term_save(struct term *term);
 int term_fd(struct term *term);
+int term_sendq(struct term *term);
+void term_flush(struct term *term);
 void term_hide(struct term *term);
+long term_mem(struct term *term);
+void term_trim(struct term *term);
+long term_spare(int drop);
+int term_warm(struct term *term, int pos, int n);
 void term_show(struct term *term);
 void term_screenshot(struct term *term, char *path);
 /* operations on the loaded terminal */
-void term_read(void);
+int term_read(int budget);
 void term_send(char *s, int n);
 void term_exec(char **args, int swsig);
 void term_end(void);
 void term_scrl(int pos);
 void term_redraw(int all);
+int term_sync(struct term *term);
+void term_colors(void);
 
 /* pad.c */
 #define FN_I		0x10000000	/* italic font */
 #define FN_B		0x20000000	/* bold font */
 #define FN_C		0x00ffffff	/* font color mask */
+#define FN_NFALL	5		/* the maximum number of fallback fonts */
 
 int pad_init(char *fr, char *fi, char *fb);
 void pad_free(void);
+void pad_fallback(char **paths);
+void pad_face(int i, char *path);
 void pad_conf(int row, int col, int rows, int cols);
 void pad_put(int ch, int r, int c, int fg, int bg);
 int pad_rows(void);
 int pad_cols(void);
 void pad_fill(int sr, int er, int sc, int ec, int c);
+void pad_copy(int sr, int er, int sc, int ec, int dr, int dc);
+void pad_blit(int r, int c, char *pix, int stride, int w, int h, int bg);
+void pad_warm(int ch, int fg, int bg);
+int pad_shrink(void);
+int pad_grow(void);
+long pad_mem(void);
 void pad_border(unsigned c, int wid);
 char *pad_fbdev(void);
+int pad_gcload(char *path);
+void pad_gcsave(char *path, int *fg, int nfg, int bg);
 int pad_crows(void);
 int pad_ccols(void);
 
@@ -52,16 +71,55 @@ struct font *font_open(char *path);
 void font_free(struct font *font);
 int font_rows(struct font *font);
 int font_cols(struct font *font);
-int font_bitmap(struct font *font, void *dst, int c);
+char *font_glyph(struct font *font, int c);
+int font_depth(struct font *font);
+unsigned font_id(char *path);
+
+/* img.c */
+#define IMGCHAR		0x80000000u	/* image cells: image id, cell row and column */
+#define IMG_CELL(id, r, c)	(IMGCHAR | ((id) << 20) | ((r) << 10) | (c))
+#define IMG_ID(ch)		(((ch) >> 20) & 0x3ff)
+#define IMG_ROW(ch)		(((ch) >> 10) & 0x3ff)
+#define IMG_COL(ch)		((ch) & 0x3ff)
+
+struct sixel *img_sixbeg(int bg);
+void img_sixput(struct sixel *six, char *s, int n);
+int img_sixend(struct sixel *six);
+void img_sixfree(struct sixel *six);
+long img_sixmem(struct sixel *six);
+int img_kitty(char *ctl, char *data, int len, int bg, int kid, char **err);
+int img_key(char *ctl, int key, int def);
+int img_kid(int kid);
+int img_b64(char *dst, char *src, int n);
+void img_drop(int id);
+int img_full(void);
+void img_unref(void);
+void img_ref(int ch);
+int img_size(int id, int *w, int *h);
+void img_cell(int ch, int r, int c, int bg);
+long img_mem(void);
+void img_evict(long mem);
+void img_done(void);
 
 /* scrsnap.c */
-void scr_snap(int idx);
-int scr_load(int idx);
+void scr_snap(int idx, int pin);
+int scr_load(int idx, int cur);
 void scr_free(int idx);
 void scr_done(void);
+void scr_limit(long mem);
+long scr_mem(int all);
 
 /* conf.c */
+/* conf_read() changes */
+#define CF_FONT		0x01	/* regular font; CF_FONT << i for font i */
+#define CF_FONTS	0x07	/* any of the fonts */
+#define CF_FALL		0x08	/* fallback fonts */
+#define CF_CLR		0x10	/* colours */
+#define CF_TAGS		0x20	/* tags */
+
 int conf_read(void);
+int conf_watch(void);
+int conf_changed(int fd);
 char *conf_tags(void);
 char *conf_saved(void);
 int conf_fg(void);
@@ -74,7 +132,12 @@ unsigned *conf_clr16(void);
 char *conf_scrshot(void);
 char *conf_term(void);
 char *conf_font(int i);
+char **conf_fallback(void);
 char **conf_command(int c);
 char *conf_pass(void);
 int conf_quitkey(void);
 int conf_brighten(void);
+int conf_hiderate(void);
+int conf_scrmem(void);
+int conf_memlimit(void);
+char *conf_gcache(void);
@@ -0,0 +1,42 @@
+/* convert a font to the builtin font of fbpad (builtin.h) */
+#include "font.c"
+
+static void putints(char *name, int *a, int n)
+{
+	int i;
+	printf("static int %s[] = {", name);
+	for (i = 0; i < n; i++)
+		printf("%s%d,", i % 16 ? " " : "\n\t", a[i]);
+	printf("\n};\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct font *font = argc > 1 ? font_open(argv[1]) : NULL;
+	long len, i;
+	unsigned id = 0;
+	if (!font) {
+		fprintf(stderr, "usage: %s font >builtin.h\n", argv[0]);
+		return 1;
+	}
+	len = (long) font->n * font->glen;
+	printf("/* the builtin font; generated by fnembed from %s */\n", argv[1]);
+	printf("static unsigned char builtin_gdat[] = {");
+	for (i = 0; i < len; i++) {
+		id = id * 31 + (unsigned char) font->gdat[i];
+		printf("%s%d,", i % 16 ? " " : "\n\t", (unsigned char) font->gdat[i]);
+	}
+	printf("\n};\n");
+	putints("builtin_bmp", font->bmp, MAX(1, font->nbmp));
+	putints("builtin_ast", font->ast, font->nast * 2);
+	printf("static struct font builtin = {\n");
+	printf("\t.rows = %d, .cols = %d, .n = %d,\n", font->rows, font->cols, font->n);
+	printf("\t.gdat = (char *) builtin_gdat, .glen = %d, .depth = %d,\n", font->glen, font->depth);
+	printf("\t.bmp = builtin_bmp, .nbmp = %d,\n", font->nbmp);
+	printf("\t.ast = builtin_ast, .nast = %d,\n", font->nast);
+	printf("};\n");
+	printf("#define BUILTIN\t\t(&builtin)\n");
+	printf("#define BUILTIN_ID\t0x%08xu\n", id);
+	font_free(font);
+	return 0;
+}
@@ -4,16 +4,22 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "fbpad.h"
 
 struct font {
 	int rows, cols;	/* glyph bitmap rows and columns */
 	int n;		/* number of font glyphs */
-	void *raw;	/* raw allocated data */
-	int *gmap;	/* glyph unicode character codes */
-	char *gdat;	/* glyph pixels (cols * rows bytes per glyph) */
-	int glen;	/* glyph data size per pixel (PSF fonts) */
-	int *gidx;	/* glyph index (PSF fonts) */
+	char *raw;	/* mmap()ed font file */
+	long len;	/* font file size */
+	char *gdat;	/* glyph pixels */
+	int glen;	/* glyph data size */
+	int depth;	/* bits per pixel: 1 (PSF), 8 or 4 (tinyfont) */
+	int *bmp;	/* glyph index plus one of BMP characters */
+	int nbmp;	/* the size of bmp[] */
+	int *ast;	/* hash table of (character, glyph) pairs for astral characters */
+	int nast;	/* the number of slots in ast[]; a power of two */
 };
 
 /*
@@ -21,10 +27,13 @@ struct font {
  *
  * glyphs[n]	unicode character codes (int)
  * bitmaps[n]	character bitmaps (char[rows * cols])
+ *
+ * In version 1, each byte of the bitmaps holds two pixels, the first
+ * in its high nibble, and bitmap rows take (cols + 1) / 2 bytes.
  */
 struct tinyfont {
 	char sig[8];		/* tinyfont signature; "tinyfont" */
-	unsigned ver;		/* version; 0 */
+	unsigned ver;		/* version; 0 or 1 */
 	unsigned n;		/* number of glyphs */
 	unsigned rows, cols;	/* glyph dimensions */
 };
@@ -40,32 +49,6 @@ struct psf2 {
 	uint32_t width;
 };
 
-static void *readfully(int fd, long *len)
-{
-	char buf[16 << 10];
-	void *out = NULL;
-	long out_n = 0;
-	long out_sz = 0;
-	long nr;
-	while ((nr = read(fd, buf, sizeof(buf))) > 0) {
-		if (out_n + nr > out_sz) {
-			char *new;
-			out_sz = out_sz + (128 << 10);
-			if (!(new = malloc(out_sz * sizeof(new)))) {
-				free(out);
-				return NULL;
-			}
-			memcpy(new, out, out_n);
-			free(out);
-			out = new;
-		}
-		memcpy(out + out_n, buf, nr);
-		out_n += nr;
-	}
-	*len = out_n;
-	return out;
-}
-
 static int uc_code(char *s, int len)
 {
 	int c = (unsigned char) s[0];
@@ -80,14 +63,89 @@ static int uc_code(char *s, int len)
 	return c;
 }
 
-/* for sorting glyphs in PSF fonts */
-struct ginfo {
-	int idx;
-	int uc;
-};
-static int ginfo_cmp(const void *g1, const void *g2)
+static int uc_len(char *s)
 {
-	return ((struct ginfo *) g1)->uc - ((struct ginfo *) g2)->uc;
+	int c = (unsigned char) s[0];
+	if (~c & 0xc0)
+		return 1;
+	if (~c & 0x20)
+		return 2;
+	if (~c & 0x10)
+		return 3;
+	return 4;
+}
+
+#include "builtin.h"
+
+#define ASTHASH(c, n)	(((unsigned) (c) * 0x9e3779b1u) & ((n) - 1))
+
+/* map character c to glyph g; only measures the tables before allocating them */
+static void font_map(struct font *font, int c, int g)
+{
+	if (c >= 0 && c < 0x10000) {
+		if (!font->bmp)
+			font->nbmp = MAX(font->nbmp, c + 1);
+		else if (!font->bmp[c])
+			font->bmp[c] = g + 1;
+	}
+	if (c >= 0x10000 && !font->ast)
+		font->nast++;
+	if (c >= 0x10000 && font->ast) {
+		int i = ASTHASH(c, font->nast);
+		while (font->ast[i * 2] && font->ast[i * 2] != c)
+			i = (i + 1) & (font->nast - 1);
+		if (!font->ast[i * 2]) {
+			font->ast[i * 2] = c;
+			font->ast[i * 2 + 1] = g;
+		}
+	}
+}
+
+/* call font_map() for the characters of each glyph */
+static void font_scan(struct font *font)
+{
+	struct psf2 *psf = (void *) font->raw;
+	int i;
+	if (font->depth != 1) {
+		int *gmap = (void *) (font->raw + sizeof(struct tinyfont));
+		for (i = 0; i < font->n; i++)
+			font_map(font, gmap[i], i);
+	} else if (psf->flags & 0x01) {
+		char *pos = font->gdat + font->n * font->glen;
+		char *end = font->raw + font->len;
+		/* unicode table: characters of each glyph, ending with 0xff */
+		for (i = 0; i < font->n && pos < end; i++) {
+			while (pos < end && (unsigned char) *pos != 0xff) {
+				if ((unsigned char) *pos == 0xfe) {	/* sequences */
+					while (pos < end && (unsigned char) *pos != 0xff)
+						pos++;
+					break;
+				}
+				font_map(font, uc_code(pos, end - pos), i);
+				pos += uc_len(pos);
+			}
+			pos++;
+		}
+	} else {
+		for (i = 0; i < font->n; i++)
+			font_map(font, i, i);
+	}
+}
+
+/* build the character to glyph index */
+static int font_index(struct font *font)
+{
+	int nast;
+	font_scan(font);
+	for (nast = 1; nast < font->nast * 2; nast <<= 1)
+		;
+	font->bmp = calloc(MAX(1, font->nbmp), sizeof(font->bmp[0]));
+	font->ast = calloc(nast * 2, sizeof(font->ast[0]));
+	font->nast = nast;
+	if (!font->bmp || !font->ast)
+		return 1;
+	font_scan(font);
+	return 0;
 }
 
 struct font *font_open(char *path)
@@ -95,127 +153,121 @@ struct font *font_open(char *path)
 	struct font *font;
 	char *tf_sig = "tinyfont";
 	char *psf_sig = "\x72\xb5\x4a\x86";
-	int fd = open(path, O_RDONLY);
+	struct tinyfont *tf;
+	struct psf2 *psf;
+	struct stat st;
+	char *raw;
 	long len;
-	char *raw = readfully(fd, &len);
-	struct tinyfont *tf = (void *) raw;
-	struct psf2 *psf = (void *) raw;
+	int fd;
+	if (!strcmp("builtin", path))
+		return BUILTIN;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*psf)) {
+		close(fd);
+		return NULL;
+	}
+	len = st.st_size;
+	raw = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
-	if (len > sizeof(*tf) && !memcmp(tf_sig, raw, 8)) {
-		int fsize = sizeof(*tf) + (tf->rows * tf->cols + sizeof(int)) * tf->n;
-		if (len < fsize || !(font = malloc(sizeof(*font))))
+	if (raw == MAP_FAILED)
+		return NULL;
+	tf = (void *) raw;
+	psf = (void *) raw;
+	if (!(font = malloc(sizeof(*font))))
+		goto nofont;
+	memset(font, 0, sizeof(*font));
+	font->raw = raw;
+	font->len = len;
+	if (len > sizeof(*tf) && !memcmp(tf_sig, raw, 8) && tf->ver <= 1) {
+		int glen = tf->rows * (tf->ver ? (tf->cols + 1) >> 1 : tf->cols);
+		long fsize = sizeof(*tf) + (glen + sizeof(int)) * (long) tf->n;
+		if (len < fsize)
 			goto nofont;
-		memset(font, 0, sizeof(*font));
-		font->raw = raw;
 		font->n = tf->n;
 		font->rows = tf->rows;
 		font->cols = tf->cols;
-		font->gmap = (void *) raw + sizeof(*tf);
-		font->gdat = (void *) raw + sizeof(*tf) + tf->n * sizeof(int);
-		return font;
-	}
-	if (len > sizeof(*psf) && !memcmp(psf_sig, raw, 4)) {
-		int fsize = sizeof(*tf) + (psf->glyphcount * psf->glyphsize) * tf->n;
-		int i;
-		if (len < fsize || !(font = malloc(sizeof(*font))))
+		font->glen = glen;
+		font->depth = tf->ver ? 4 : 8;
+		font->gdat = raw + sizeof(*tf) + tf->n * sizeof(int);
+	} else if (len > sizeof(*psf) && !memcmp(psf_sig, raw, 4)) {
+		long fsize = psf->headersize + psf->glyphcount * (long) psf->glyphsize;
+		if (len < fsize || psf->glyphsize < psf->height * ((psf->width + 7) >> 3))
 			goto nofont;
-		memset(font, 0, sizeof(*font));
-		font->raw = raw;
 		font->n = psf->glyphcount;
 		font->rows = psf->height;
 		font->cols = psf->width;
 		font->glen = psf->glyphsize;
+		font->depth = 1;
 		font->gdat = raw + psf->headersize;
-		font->gmap = malloc(font->n * sizeof(font->gmap[0]));
-		font->gidx = malloc(font->n * sizeof(font->gmap[0]));
-		if (!font->gmap || !font->gidx) {
-			font_free(font);
-			return NULL;
-		}
-		for (i = 0; i < font->n; i++)
-			font->gmap[i] = i;
-		for (i = 0; i < font->n; i++)
-			font->gidx[i] = i;
-		if (psf->flags & 0x01) {
-			char *pos = raw + fsize;
-			char *end = raw + len;
-			struct ginfo *gi = malloc(font->n * sizeof(gi[0]));
-			if (!gi) {
-				font_free(font);
-				return NULL;
-			}
-			for (i = 0; i < font->n; i++) {
-				char *eoc = memchr(pos, 0xff, end - pos);
-				gi[i].idx = i;
-				gi[i].uc = i;
-				if (eoc && pos < eoc)
-					gi[i].uc = uc_code(pos, eoc - pos);
-				pos = eoc + 1;
-			}
-			qsort(gi, font->n, sizeof(gi[0]), ginfo_cmp);
-			for (i = 0; i < font->n; i++) {
-				font->gidx[i] = gi[i].idx;
-				font->gmap[i] = gi[i].uc;
-			}
-			free(gi);
-		}
-		return font;
+	} else {
+		goto nofont;
 	}
+	if (font_index(font))
+		goto nofont;
+	return font;
 nofont:
-	free(raw);
+	if (font) {
+		free(font->bmp);
+		free(font->ast);
+		free(font);
+	}
+	munmap(raw, len);
 	return NULL;
 }
 
 static int find_glyph(struct font *font, int c)
 {
-	int l = 0;
-	int h = font->n;
-	while (l < h) {
-		int m = (l + h) / 2;
-		if (font->gmap[m] == c)
-			return m;
-		if (c < font->gmap[m])
-			h = m;
-		else
-			l = m + 1;
+	int i;
+	if (c >= 0 && c < font->nbmp)
+		return font->bmp[c] - 1;
+	if (c < 0x10000)
+		return -1;
+	i = ASTHASH(c, font->nast);
+	while (font->ast[i * 2]) {
+		if (font->ast[i * 2] == c)
+			return font->ast[i * 2 + 1];
+		i = (i + 1) & (font->nast - 1);
 	}
 	return -1;
 }
 
-int font_bitmap(struct font *font, void *dst, int c)
+/* glyph bitmap of c, with rows of (cols * depth + 7) / 8 bytes */
+char *font_glyph(struct font *font, int c)
 {
 	int i = find_glyph(font, c);
-	if (i < 0)
-		return 1;
-	if (font->glen) {
-		char *beg = font->gdat + font->gidx[i] * font->glen;
-		int rlen = (font->cols + 7) >> 3;
-		int i, j;
-		for (i = 0; i < font->rows; i++) {
-			unsigned char *row = (unsigned char *) beg + i * rlen;
-			for (j = 0; j < font->cols; j++) {
-				int val = row[j >> 3] & (1 << (7 - (j & 0x7)));
-				((unsigned char *) dst)[i * font->cols + j] = val ? 255 : 0;
-			}
-		}
-	} else {
-		int len = font->rows * font->cols;
-		memcpy(dst, font->gdat + i * len, len);
-	}
-	return 0;
+	return i >= 0 ? font->gdat + i * font->glen : NULL;
+}
+
+/* bits per pixel of glyph bitmaps; the most significant bits come first */
+int font_depth(struct font *font)
+{
+	return font->depth;
 }
 
 void font_free(struct font *font)
 {
-	if (font)
-		free(font->raw);
-	if (font && font->glen)
-		free(font->gmap);
-	if (font && font->glen)
-		free(font->gidx);
+	if (font == BUILTIN)
+		return;
+	if (font) {
+		munmap(font->raw, font->len);
+		free(font->bmp);
+		free(font->ast);
+	}
 	free(font);
 }
 
+/* font file identity, without opening it; changes when the file is modified */
+unsigned font_id(char *path)
+{
+	struct stat st;
+	if (!strcmp("builtin", path))
+		return BUILTIN_ID;
+	if (!path[0] || stat(path, &st) < 0)
+		return 0;
+	return ((st.st_dev * 31 + st.st_ino) * 31 + st.st_size) * 31 + st.st_mtime;
+}
+
 int font_rows(struct font *font)
 {
 	return font->rows;
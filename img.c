@@ -0,0 +1,599 @@
+/* decoded images shown in terminal cells */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "draw.h"
+#include "fbpad.h"
+
+#define IMGCNT		1024		/* the number of image ids */
+#define IMGMEM		(32 << 20)	/* memory for decoded images */
+#define IMGDIM		4096		/* maximum image width and height */
+
+struct img {
+	char *pix;		/* pixels in framebuffer format */
+	int w, h;		/* image size in pixels */
+	unsigned long long hash;	/* the hash of the encoded image */
+	int len;		/* the length of the encoded image */
+	int kid;		/* the id given by the application (kitty protocol) */
+	unsigned long used;	/* last use for LRU eviction */
+};
+
+static struct img imgs[IMGCNT];
+static char img_refd[IMGCNT];	/* cells may refer to the id; it is not reused */
+static int img_next;		/* the next id to allocate */
+static unsigned long img_clock;
+
+/* continue hash h with n bytes of s */
+static unsigned long long img_hash(unsigned long long h, char *s, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		h = (h ^ (unsigned char) s[i]) * 0x100000001b3ull;
+	return h;
+}
+
+static void img_free(int id)
+{
+	free(imgs[id].pix);
+	memset(&imgs[id], 0, sizeof(imgs[id]));
+}
+
+long img_mem(void)
+{
+	int bpp = FBM_BPP(fb_mode());
+	long mem = 0;
+	int i;
+	for (i = 0; i < IMGCNT; i++)
+		if (imgs[i].pix)
+			mem += (long) imgs[i].w * imgs[i].h * bpp;
+	return mem;
+}
+
+/* the memory for images: IMGMEM, unless memlimit is smaller */
+static long img_max(void)
+{
+	long lim = conf_memlimit() * 1024l;
+	return lim > 0 ? MIN(IMGMEM, lim) : IMGMEM;
+}
+
+/* free the least recently used images until they use at most mem bytes */
+void img_evict(long mem)
+{
+	int i, lru;
+	while (img_mem() > mem) {
+		lru = -1;
+		for (i = 0; i < IMGCNT; i++)
+			if (imgs[i].pix && (lru < 0 || imgs[i].used < imgs[lru].used))
+				lru = i;
+		img_free(lru);
+	}
+}
+
+/* the cached image with the same encoding or -1 */
+static int img_find(unsigned long long hash, int len)
+{
+	int i;
+	for (i = 0; i < IMGCNT; i++) {
+		if (imgs[i].pix && imgs[i].hash == hash && imgs[i].len == len) {
+			imgs[i].used = ++img_clock;
+			img_refd[i] = 1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* store pix (w x h pixels in framebuffer format) as a new image; returns its id */
+static int img_new(char *pix, int w, int h, unsigned long long hash, int len)
+{
+	int bpp = FBM_BPP(fb_mode());
+	int id = img_next;
+	int j;
+	if ((long) w * h * bpp > img_max()) {
+		free(pix);
+		return -1;
+	}
+	/* prefer ids without images; ids still in cells are never reused */
+	for (j = 0; j < IMGCNT && (imgs[id].pix || img_refd[id]); j++)
+		id = (id + 1) % IMGCNT;
+	for (j = 0; j < IMGCNT && img_refd[id]; j++)
+		id = (id + 1) % IMGCNT;
+	if (img_refd[id]) {
+		free(pix);
+		return -1;
+	}
+	if (imgs[id].pix)
+		img_free(id);
+	img_refd[id] = 1;
+	img_next = (id + 1) % IMGCNT;
+	imgs[id].pix = pix;
+	imgs[id].w = w;
+	imgs[id].h = h;
+	imgs[id].hash = hash;
+	imgs[id].len = len;
+	imgs[id].used = ++img_clock;
+	img_evict(img_max());
+	return id;
+}
+
+/* add an image of w x h RGB pixels (0xff000000 marks set pixels); returns its id */
+static int img_add(unsigned *rgb, int w, int h, int bg, unsigned long long hash, int len)
+{
+	int bpp = FBM_BPP(fb_mode());
+	char *pix = malloc((long) w * h * bpp);
+	long i;
+	int j;
+	if (!pix)
+		return -1;
+	for (i = 0; i < (long) w * h; i++) {
+		unsigned c = rgb[i] ? rgb[i] : bg;
+		unsigned v = fb_val((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+		for (j = 0; j < bpp; j++)
+			pix[i * bpp + j] = (v >> (j << 3)) & 0xff;
+	}
+	return img_new(pix, w, h, hash, len);
+}
+
+/* free image id */
+void img_drop(int id)
+{
+	if (id >= 0 && id < IMGCNT)
+		img_free(id);
+}
+
+/* all ids are referenced by cells; term.c should look for unused ones */
+int img_full(void)
+{
+	int i;
+	for (i = 0; i < IMGCNT; i++)
+		if (!img_refd[i])
+			return 0;
+	return 1;
+}
+
+/* forget the references to images; img_ref() marks the ones in cells again */
+void img_unref(void)
+{
+	memset(img_refd, 0, sizeof(img_refd));
+}
+
+/* image cell ch is in a terminal */
+void img_ref(int ch)
+{
+	img_refd[IMG_ID(ch)] = 1;
+}
+
+/* the size of image id in pixels; returns nonzero if it does not exist */
+int img_size(int id, int *w, int *h)
+{
+	if (id < 0 || id >= IMGCNT || !imgs[id].pix)
+		return 1;
+	*w = imgs[id].w;
+	*h = imgs[id].h;
+	return 0;
+}
+
+/* draw image cell ch (see IMG_CELL) at row r and column c */
+void img_cell(int ch, int r, int c, int bg)
+{
+	struct img *img = &imgs[IMG_ID(ch)];
+	int bpp = FBM_BPP(fb_mode());
+	int x = IMG_COL(ch) * pad_ccols();
+	int y = IMG_ROW(ch) * pad_crows();
+	if (!img->pix || x >= img->w || y >= img->h) {
+		pad_blit(r, c, NULL, 0, 0, 0, bg);
+		return;
+	}
+	pad_blit(r, c, img->pix + ((long) y * img->w + x) * bpp, img->w * bpp,
+		MIN(pad_ccols(), img->w - x), MIN(pad_crows(), img->h - y), bg);
+}
+
+void img_done(void)
+{
+	int i;
+	for (i = 0; i < IMGCNT; i++)
+		img_free(i);
+}
+
+/* sixel decoding; images are decoded as their bytes arrive */
+
+struct sixel {
+	unsigned clr[256];	/* colour registers */
+	unsigned *rgb;		/* the canvas; 0xff000000 marks set pixels */
+	int cw, ch;		/* canvas size */
+	int w, h;		/* image size */
+	int x, y;		/* the position of the next sixel */
+	int cur;		/* the current colour */
+	int rep;		/* the repeat count of the next sixel */
+	int cmd;		/* the command whose arguments are being read or 0 */
+	int args[5], narg;	/* its arguments */
+	int bg;
+	unsigned long long hash;	/* the hash of the image and bg */
+	int len;		/* the length of the image */
+};
+
+static unsigned six_clr16[] = {
+	0x000000, 0x3333cc, 0xcc2121, 0x33cc33,
+	0xcc33cc, 0x33cccc, 0xcccc33, 0x878787,
+	0x424242, 0x545499, 0x994242, 0x549954,
+	0x995499, 0x549999, 0x999954, 0xcccccc,
+};
+
+static int six_hue(int m1, int m2, int h)
+{
+	h = (h + 360) % 360;
+	if (h < 60)
+		return m1 + (m2 - m1) * h / 60;
+	if (h < 180)
+		return m2;
+	if (h < 240)
+		return m1 + (m2 - m1) * (240 - h) / 60;
+	return m1;
+}
+
+/* sixel HLS (hue 0 is blue; percentages) to RGB */
+static unsigned six_hls(int h, int l, int s)
+{
+	int m2 = l <= 50 ? l * (100 + s) / 100 : l + s - l * s / 100;
+	int m1 = 2 * l - m2;
+	int r, g, b;
+	if (!s)
+		return ((l * 255 / 100) << 16) | ((l * 255 / 100) << 8) | (l * 255 / 100);
+	h += 240;
+	r = six_hue(m1, m2, h + 120) * 255 / 100;
+	g = six_hue(m1, m2, h) * 255 / 100;
+	b = six_hue(m1, m2, h - 120) * 255 / 100;
+	return (MIN(255, MAX(0, r)) << 16) | (MIN(255, MAX(0, g)) << 8) | MIN(255, MAX(0, b));
+}
+
+/* make the canvas at least w x h pixels */
+static int six_grow(unsigned **rgb, int *cw, int *ch, int w, int h)
+{
+	int nw = *cw, nh = *ch;
+	unsigned *n;
+	int i;
+	if (w <= *cw && h <= *ch)
+		return 0;
+	if (w > IMGDIM || h > IMGDIM || (long) w * h * sizeof(n[0]) > img_max())
+		return 1;
+	while (nw < w)
+		nw = MIN(IMGDIM, MAX(64, nw * 2));
+	while (nh < h)
+		nh = MIN(IMGDIM, MAX(64, nh * 2));
+	if ((long) nw * nh * sizeof(n[0]) > img_max()) {
+		nw = MAX(w, *cw);
+		nh = MAX(h, *ch);
+	}
+	if (!(n = calloc((long) nw * nh, sizeof(n[0]))))
+		return 1;
+	for (i = 0; i < *ch; i++)
+		memcpy(n + (long) i * nw, *rgb + (long) i * *cw, *cw * sizeof(n[0]));
+	free(*rgb);
+	*rgb = n;
+	*cw = nw;
+	*ch = nh;
+	return 0;
+}
+
+/* apply the command whose arguments have been read */
+static void six_cmd(struct sixel *six)
+{
+	int *args = six->args;
+	switch (six->cmd) {
+	case '"':	/* raster attributes: Pan;Pad;Ph;Pv */
+		/* the declared size is limited to the screen; drawn pixels extend it */
+		six->w = MAX(six->w, MIN(MIN(args[2], IMGDIM), pad_cols() * pad_ccols()));
+		six->h = MAX(six->h, MIN(MIN(args[3], IMGDIM), pad_rows() * pad_crows()));
+		break;
+	case '#':	/* colour: Pc or Pc;Pu;Px;Py;Pz */
+		six->cur = args[0] & 0xff;
+		if (six->narg >= 4 && args[1] == 1)
+			six->clr[six->cur] = six_hls(args[2], args[3], args[4]);
+		if (six->narg >= 4 && args[1] == 2)
+			six->clr[six->cur] = (MIN(100, args[2]) * 255 / 100 << 16) |
+				(MIN(100, args[3]) * 255 / 100 << 8) |
+				(MIN(100, args[4]) * 255 / 100);
+		break;
+	case '!':	/* repeat the next sixel: ! Pn sixel */
+		six->rep = MAX(1, args[0]);
+		break;
+	}
+	six->cmd = 0;
+}
+
+/* draw sixel c six->rep times */
+static void six_draw(struct sixel *six, int c)
+{
+	int rep = six->rep;
+	int i, k;
+	if (six_grow(&six->rgb, &six->cw, &six->ch, six->x + rep, six->y + 6))
+		rep = MAX(0, MIN(rep, six->cw - six->x));
+	if (six->y + 6 > six->ch)
+		return;
+	for (k = 0; k < 6; k++) {
+		unsigned *d = six->rgb + (long) (six->y + k) * six->cw + six->x;
+		if ((c - 0x3f) & (1 << k))
+			for (i = 0; i < rep; i++)
+				d[i] = six->clr[six->cur] | 0xff000000;
+	}
+	six->x += rep;
+	six->w = MAX(six->w, MIN(six->x, IMGDIM));
+	six->h = MAX(six->h, six->y + 6);
+}
+
+/* start decoding a sixel image drawn on bg */
+struct sixel *img_sixbeg(int bg)
+{
+	struct sixel *six = malloc(sizeof(*six));
+	if (!six)
+		return NULL;
+	memset(six, 0, sizeof(*six));
+	memcpy(six->clr, six_clr16, sizeof(six_clr16));
+	six->rep = 1;
+	six->bg = bg;
+	six->hash = 0xcbf29ce484222325ull ^ (unsigned) bg;
+	return six;
+}
+
+/* decode the next n bytes of the image (after the final q of DCS) */
+void img_sixput(struct sixel *six, char *s, int n)
+{
+	int i, c;
+	six->hash = img_hash(six->hash, s, n);
+	six->len += n;
+	for (i = 0; i < n; i++) {
+		c = (unsigned char) s[i];
+		if (six->cmd && ((c >= '0' && c <= '9') || c == ';')) {
+			if (c == ';')
+				six->narg = MIN(six->narg + 1, LEN(six->args));
+			else if (six->narg < LEN(six->args))
+				six->args[six->narg] = MIN(six->args[six->narg] * 10 + (c - '0'), 1 << 20);
+			continue;
+		}
+		if (six->cmd)
+			six_cmd(six);
+		switch (c) {
+		case '"':
+		case '#':
+		case '!':
+			six->cmd = c;
+			six->rep = 1;
+			six->narg = 0;
+			memset(six->args, 0, sizeof(six->args));
+			continue;
+		case '$':	/* graphics carriage return */
+			six->x = 0;
+			break;
+		case '-':	/* graphics new line */
+			six->x = 0;
+			six->y = MIN(six->y + 6, IMGDIM);
+			break;
+		default:
+			if (c >= 0x3f && c <= 0x7e)
+				six_draw(six, c);
+		}
+		six->rep = 1;
+	}
+}
+
+/* allocated bytes */
+long img_sixmem(struct sixel *six)
+{
+	return six ? sizeof(*six) + (long) six->cw * six->ch * sizeof(six->rgb[0]) : 0;
+}
+
+void img_sixfree(struct sixel *six)
+{
+	if (six)
+		free(six->rgb);
+	free(six);
+}
+
+/* finish decoding the image; returns its id or -1 */
+int img_sixend(struct sixel *six)
+{
+	int w, h, id, i;
+	if (!six)
+		return -1;
+	if (six->cmd)
+		six_cmd(six);
+	w = six->w;
+	h = six->h;
+	/* an image received again is not stored twice */
+	if ((id = img_find(six->hash, six->len)) >= 0) {
+		img_sixfree(six);
+		return id;
+	}
+	if (!w || !h || six_grow(&six->rgb, &six->cw, &six->ch, w, h)) {
+		img_sixfree(six);
+		return -1;
+	}
+	/* make the canvas w pixels wide */
+	for (i = 1; i < h; i++)
+		memmove(six->rgb + (long) i * w, six->rgb + (long) i * six->cw, w * sizeof(six->rgb[0]));
+	id = img_add(six->rgb, w, h, six->bg, six->hash, six->len);
+	img_sixfree(six);
+	return id;
+}
+
+/* kitty graphics protocol */
+
+/* the value of key k in control data ctl ("k=v,..."); letters are returned as is */
+int img_key(char *ctl, int k, int def)
+{
+	char *s = ctl;
+	while (*s) {
+		if (s[0] == k && s[1] == '=')
+			return s[2] >= 'a' || (s[2] >= 'A' && s[2] <= 'Z') ?
+				s[2] : atoi(s + 2);
+		while (*s && *s != ',')
+			s++;
+		if (*s)
+			s++;
+	}
+	return def;
+}
+
+/* the image with kitty id kid or -1 */
+int img_kid(int kid)
+{
+	int i;
+	for (i = 0; i < IMGCNT && kid; i++) {
+		if (imgs[i].pix && imgs[i].kid == kid) {
+			img_refd[i] = 1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int b64val(int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+/* decode n bytes of base64 src into dst; returns the number of bytes written */
+int img_b64(char *dst, char *src, int n)
+{
+	char *d = dst;
+	int acc = 0, bits = 0;
+	int i, v;
+	for (i = 0; i < n; i++) {
+		if ((v = b64val((unsigned char) src[i])) < 0)
+			continue;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			*d++ = (acc >> bits) & 0xff;
+		}
+	}
+	return d - dst;
+}
+
+/* a temporary file of the protocol, which is directly in a temporary directory */
+static int img_tmpfile(char *path)
+{
+	char *dirs[] = {"/tmp", "/dev/shm", getenv("TMPDIR")};
+	char *base = strrchr(path, '/');
+	int i, n;
+	if (!base || !strstr(base, "tty-graphics-protocol"))
+		return 0;
+	for (i = 0; i < LEN(dirs); i++) {
+		n = dirs[i] ? strlen(dirs[i]) : 0;
+		while (n > 1 && dirs[i][n - 1] == '/')
+			n--;
+		if (n && base - path == n && !strncmp(path, dirs[i], n))
+			return 1;
+	}
+	return 0;
+}
+
+/* map the file or shared memory object (medium 's') name */
+static char *img_map(int medium, char *name, long off, long len)
+{
+	char path[512];
+	struct stat st;
+	char *map;
+	int fd;
+	if (strchr(name, '/') && medium == 's')
+		return NULL;
+	snprintf(path, sizeof(path), "%s%s", medium == 's' ? "/dev/shm/" : "", name);
+	/* FIFOs and devices must not block fbpad; only regular files are read */
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || off < 0 || st.st_size < off + len) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, off + len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	/* shared memory objects and temporary files are removed after reading */
+	if (medium == 's' || (medium == 't' && img_tmpfile(path)))
+		unlink(path);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/* store the RGB or RGBA image of a kitty transmission; returns its id or -1 */
+/* + data is the pixels or, for other mediums, the path of the file that has them */
+/* + kid: the id of the image; it replaces the image with the same id, if nonzero */
+int img_kitty(char *ctl, char *data, int len, int bg, int kid, char **err)
+{
+	int bpp = FBM_BPP(fb_mode());
+	int f = img_key(ctl, 'f', 32);
+	int medium = img_key(ctl, 't', 'd');
+	int w = img_key(ctl, 's', 0);
+	int h = img_key(ctl, 'v', 0);
+	int dep = f / 8;
+	long off = img_key(ctl, 'O', 0);
+	long n = (long) w * h * dep;
+	char name[256];
+	char *map = NULL;
+	char *src = data;
+	char *pix;
+	long i;
+	int j, id;
+	if ((f != 24 && f != 32) || img_key(ctl, 'o', 0)) {
+		*err = "ENOTSUPPORTED:only RGB and RGBA images are supported";
+		return -1;
+	}
+	if (!medium || !strchr("dfts", medium)) {
+		*err = "EINVAL:unsupported transmission medium";
+		return -1;
+	}
+	if (w <= 0 || h <= 0 || w > IMGDIM || h > IMGDIM) {
+		*err = "EINVAL:bad image size";
+		return -1;
+	}
+	if ((long) w * h * bpp > img_max()) {
+		*err = "ENOMEM:image too large";
+		return -1;
+	}
+	if (medium != 'd') {
+		snprintf(name, sizeof(name), "%.*s", len, data);
+		if (!(map = img_map(medium, name, off, n))) {
+			*err = "EBADF:cannot read the image";
+			return -1;
+		}
+		src = map + off;
+	} else if (len < n) {
+		*err = "ENODATA:insufficient image data";
+		return -1;
+	}
+	if ((pix = malloc((long) w * h * bpp))) {
+		for (i = 0; i < (long) w * h; i++) {
+			unsigned char *s = (unsigned char *) src + i * dep;
+			int a = dep == 4 ? s[3] : 255;
+			int r = (s[0] * a + ((bg >> 16) & 0xff) * (255 - a)) / 255;
+			int g = (s[1] * a + ((bg >> 8) & 0xff) * (255 - a)) / 255;
+			int b = (s[2] * a + (bg & 0xff) * (255 - a)) / 255;
+			unsigned v = fb_val(r, g, b);
+			for (j = 0; j < bpp; j++)
+				pix[i * bpp + j] = (v >> (j << 3)) & 0xff;
+		}
+	}
+	if (map)
+		munmap(map, off + n);
+	if (!pix || (id = img_new(pix, w, h, 0, 0)) < 0) {
+		*err = "ENOMEM:cannot store the image";
+		return -1;
+	}
+	if (img_kid(kid) >= 0)
+		img_free(img_kid(kid));
+	imgs[id].kid = kid;
+	return id;
+}
@@ -1,7 +1,11 @@
 #include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "draw.h"
 #include "fbpad.h"
 
@@ -9,10 +13,26 @@ static int fbroff, fbcoff, fbrows, fbcols;
 static int rows, cols;
 static int fnrows, fncols;
 static int bpp;
-static struct font *fonts[3];
+#define FNMAX		(3 + FN_NFALL)	/* regular, italic, bold, and fallback fonts */
+
+static struct font *fonts[FNMAX];
+static char fnpath[FNMAX][512];	/* font paths; all but the regular are opened on demand */
+static int fntried[FNMAX];	/* font_open() was tried */
+static unsigned char *fnbmp;	/* the font of BMP characters: 0 unknown, 255 none, or font + 1 */
+static int fnast[256][2];	/* the font of recent astral characters */
 
 static int gc_init(int grows, int gcols);
 static void gc_free(void);
+static void at_free(void);
+static void rm_reset(void);
+
+/* forget the fonts found for characters */
+static void fn_reset(void)
+{
+	free(fnbmp);
+	fnbmp = NULL;
+	memset(fnast, 0, sizeof(fnast));
+}
 
 static int pad_font(char *fr, char *fi, char *fb)
 {
@@ -23,8 +43,15 @@ static int pad_font(char *fr, char *fi, char *fb)
 	font_free(fonts[1]);
 	font_free(fonts[2]);
 	fonts[0] = r;
-	fonts[1] = fi ? font_open(fi) : NULL;
-	fonts[2] = fb ? font_open(fb) : NULL;
+	fonts[1] = NULL;
+	fonts[2] = NULL;
+	snprintf(fnpath[0], sizeof(fnpath[0]), "%s", fr);
+	snprintf(fnpath[1], sizeof(fnpath[1]), "%s", fi ? fi : "");
+	snprintf(fnpath[2], sizeof(fnpath[2]), "%s", fb ? fb : "");
+	fntried[1] = 0;
+	fntried[2] = 0;
+	fn_reset();
+	at_free();
 	return 0;
 }
 
@@ -37,6 +64,7 @@ int pad_init(char *fr, char *fi, char *fb)
 	rows = fb_rows() / fnrows;
 	cols = fb_cols() / fncols;
 	bpp = FBM_BPP(fb_mode());
+	rm_reset();
 	pad_conf(0, 0, fb_rows(), fb_cols());
 	return 0;
 }
@@ -51,12 +79,39 @@ void pad_conf(int roff, int coff, int _rows, int _cols)
 	cols = fbcols / fncols;
 }
 
+/* set the fallback fonts; paths is NULL-terminated */
+void pad_fallback(char **paths)
+{
+	int i;
+	for (i = 3; i < FNMAX; i++) {
+		font_free(fonts[i]);
+		fonts[i] = NULL;
+		fntried[i] = 0;
+		snprintf(fnpath[i], sizeof(fnpath[i]), "%s", paths && *paths ? *paths++ : "");
+	}
+	fn_reset();
+	gc_init(fnrows, fncols);
+	at_free();
+}
+
 void pad_free(void)
 {
+	int i;
 	gc_free();
-	font_free(fonts[0]);
-	font_free(fonts[1]);
-	font_free(fonts[2]);
+	at_free();
+	fn_reset();
+	for (i = 0; i < FNMAX; i++)
+		font_free(fonts[i]);
+	memset(fonts, 0, sizeof(fonts));
+}
+
+/* open font i on its first use */
+static struct font *fnload(int i)
+{
+	if (!fonts[i] && !fntried[i] && fnpath[i][0])
+		fonts[i] = font_open(fnpath[i]);
+	fntried[i] = 1;
+	return fonts[i];
 }
 
 #define CR(a)		(((a) >> 16) & 0x0000ff)
@@ -81,15 +136,16 @@ static void fb_mixed(char *d, int fg, int bg, unsigned val)
 	fb_set(d, r, g, b);
 }
 
-/* glyph bitmap cache: use CGLCNT lists of size CGLLEN each */
+/* glyph bitmap cache: use CGLCNT lists of size gc_len (at most CGLLEN) each */
 #define GCLCNT		(1 << 7)		/* glyph cache list count */
-#define GCLLEN		(1 << 4)		/* glyph cache list length */
+#define GCLLEN		(1 << 4)		/* maximum glyph cache list length */
 #define GCN		(GCLCNT * GCLLEN)	/* total glpyhs */
 #define GCGLEN(rs, cs)	((rs) * (cs) * 4)	/* bytes to store a glyph */
 #define GCIDX(c)	((c) & (GCLCNT - 1))
 
 static char *gc_mem;		/* cached glyph's memory */
 static int gc_rows, gc_cols;	/* glyph size */
+static int gc_len;		/* glyph cache list length */
 static int gc_next[GCLCNT];	/* the next slot to use in each list */
 static int gc_glyph[GCN];	/* cached glyphs */
 static int gc_bg[GCN];
@@ -107,10 +163,47 @@ static int gc_init(int grows, int gcols)
 		gc_mem = mem;
 		gc_rows = grows;
 		gc_cols = gcols;
+		gc_len = GCLLEN;
 	}
 	return !mem;
 }
 
+/* halve the glyph cache; returns nonzero if it cannot shrink */
+int pad_shrink(void)
+{
+	char *mem;
+	if (!gc_mem || gc_len <= 1)
+		return 1;
+	gc_len /= 2;
+	if ((mem = realloc(gc_mem, GCLCNT * gc_len * GCGLEN(gc_rows, gc_cols))))
+		gc_mem = mem;
+	memset(gc_next, 0, sizeof(gc_next));
+	memset(gc_glyph, 0, sizeof(gc_glyph));
+	return 0;
+}
+
+/* double the glyph cache halved by pad_shrink(); returns nonzero if it cannot grow */
+int pad_grow(void)
+{
+	char *mem;
+	if (!gc_mem || gc_len >= GCLLEN)
+		return 1;
+	if (!(mem = realloc(gc_mem, GCLCNT * gc_len * 2 * GCGLEN(gc_rows, gc_cols))))
+		return 1;
+	gc_mem = mem;
+	gc_len *= 2;
+	memset(gc_next, 0, sizeof(gc_next));
+	memset(gc_glyph, 0, sizeof(gc_glyph));
+	return 0;
+}
+
+/* allocated bytes, other than fonts */
+long pad_mem(void)
+{
+	return (gc_mem ? (long) GCLCNT * gc_len * GCGLEN(gc_rows, gc_cols) : 0) +
+		(fnbmp ? 0x10000 : 0);
+}
+
 static void gc_free(void)
 {
 	free(gc_mem);
@@ -118,9 +211,9 @@ static void gc_free(void)
 
 static char *gc_get(int c, int fg, int bg)
 {
-	int idx = GCIDX(c) * GCLLEN;
+	int idx = GCIDX(c) * gc_len;
 	int i;
-	for (i = idx; i < idx + GCLLEN; i++)
+	for (i = idx; i < idx + gc_len; i++)
 		if (gc_glyph[i] == c && gc_fg[i] == fg && gc_bg[i] == bg)
 			return gc_mem + i * GCGLEN(gc_rows, gc_cols);
 	return NULL;
@@ -130,8 +223,8 @@ static char *gc_put(int c, int fg, int bg)
 {
 	int lst = GCIDX(c);
 	int pos = gc_next[lst]++;
-	int idx = lst * GCLLEN + pos;
-	if (gc_next[lst] >= GCLLEN)
+	int idx = lst * gc_len + pos;
+	if (gc_next[lst] >= gc_len)
 		gc_next[lst] = 0;
 	gc_glyph[idx] = c;
 	gc_fg[idx] = fg;
@@ -139,32 +232,249 @@ static char *gc_put(int c, int fg, int bg)
 	return gc_mem + idx * GCGLEN(gc_rows, gc_cols);
 }
 
-static void bmp2fb(char *d, char *s, int fg, int bg, int nr, int nc)
+/* blend ramps: framebuffer pixels of the 256 levels between bg and fg */
+#define RMCNT		(1 << 4)		/* number of cached ramps */
+#define RMHASH(fg, bg)	((((unsigned) (fg) * 0x9e3779b1u) ^ (unsigned) (bg)) >> 28)
+
+static char rm_pix[RMCNT][256 * 4];
+static int rm_fg[RMCNT];
+static int rm_bg[RMCNT];
+static int rm_ok[RMCNT];
+
+static void rm_reset(void)
 {
-	int i, j;
+	memset(rm_ok, 0, sizeof(rm_ok));
+}
+
+static char *ramp(int fg, int bg)
+{
+	int i = RMHASH(fg, bg);
+	int j;
+	if (!rm_ok[i] || rm_fg[i] != fg || rm_bg[i] != bg) {
+		for (j = 0; j < 256; j++)
+			fb_mixed(rm_pix[i] + j * bpp, fg, bg, j);
+		rm_fg[i] = fg;
+		rm_bg[i] = bg;
+		rm_ok[i] = 1;
+	}
+	return rm_pix[i];
+}
+
+/* expand glyph bitmap s of font fn to framebuffer pixels */
+static void bmp2fb(char *d, struct font *fn, char *s, int fg, int bg)
+{
+	char *lvl = ramp(fg, bg);
+	int nr = font_rows(fn);
+	int nc = font_cols(fn);
+	int depth = font_depth(fn);
+	int rlen = (nc * depth + 7) >> 3;
+	int i, j, v;
 	for (i = 0; i < fnrows; i++) {
+		unsigned char *row = (unsigned char *) s + i * rlen;
 		char *p = d + i * fncols * bpp;
 		for (j = 0; j < fncols; j++) {
-			unsigned v = i < nr && j < nc ?
-				(unsigned char) s[i * nc + j] : 0;
-			fb_mixed(p + j * bpp, fg, bg, v);
+			if (i >= nr || j >= nc)
+				v = 0;
+			else if (depth == 1)
+				v = (row[j >> 3] >> (7 - (j & 7))) & 1 ? 255 : 0;
+			else if (depth == 4)
+				v = ((row[j >> 1] >> (j & 1 ? 0 : 4)) & 15) * 17;
+			else
+				v = row[j];
+			memcpy(p + j * bpp, lvl + v * bpp, bpp);
+		}
+	}
+}
+
+/* glyph atlas: glyphs rendered in previous runs, mapped from a file */
+#define ATSIG		"fbpadgc"
+#define ATMAX		(1 << 13)		/* maximum atlas glyphs */
+#define ATHASH(c, fg, bg, n)	(((unsigned) (c) * 0x9e3779b1u ^ \
+				(unsigned) (fg) * 0x85ebca6bu ^ (unsigned) (bg)) & ((n) - 1))
+
+/*
+ * This atlas header is followed by:
+ *
+ * slots[n]	index slots (int[4]: character or -1, fg, bg, glyph)
+ * glyphs[]	glyph bitmaps in framebuffer format (char[glen])
+ */
+struct atlas {
+	char sig[8];		/* atlas signature; "fbpadgc" */
+	unsigned key;		/* fonts, glyph size, and pixel format */
+	unsigned n;		/* number of index slots; a power of two */
+	unsigned cnt;		/* number of glyphs */
+	unsigned glen;		/* bytes per glyph */
+};
+
+static char *at_mem;		/* mmap()ed atlas file */
+static long at_len;
+static int *at_slot;		/* atlas index slots */
+static char *at_glyph;		/* atlas glyph bitmaps */
+static int at_n;		/* number of atlas slots */
+static int at_glen;		/* bytes per atlas glyph */
+
+static unsigned at_key(void)
+{
+	unsigned key = (fb_mode() * 31 + fnrows) * 31 + fncols;
+	int i;
+	for (i = 0; i < LEN(fnpath); i++)
+		key = key * 31 + font_id(fnpath[i]);
+	return key;
+}
+
+static void at_free(void)
+{
+	if (at_mem)
+		munmap(at_mem, at_len);
+	at_mem = NULL;
+}
+
+static char *at_get(int c, int fg, int bg)
+{
+	int i;
+	if (!at_mem)
+		return NULL;
+	for (i = ATHASH(c, fg, bg, at_n); at_slot[i * 4] != -1; i = (i + 1) & (at_n - 1))
+		if (at_slot[i * 4] == c && at_slot[i * 4 + 1] == fg && at_slot[i * 4 + 2] == bg)
+			return at_glyph + at_slot[i * 4 + 3] * at_glen;
+	return NULL;
+}
+
+/* insert a glyph into the atlas index; returns the new glyph or NULL */
+static char *at_put(int *slot, int n, char *glyph, int *cnt, int c, int fg, int bg)
+{
+	int i = ATHASH(c, fg, bg, n);
+	while (slot[i * 4] != -1) {
+		if (slot[i * 4] == c && slot[i * 4 + 1] == fg && slot[i * 4 + 2] == bg)
+			return NULL;
+		i = (i + 1) & (n - 1);
+	}
+	slot[i * 4] = c;
+	slot[i * 4 + 1] = fg;
+	slot[i * 4 + 2] = bg;
+	slot[i * 4 + 3] = (*cnt)++;
+	return glyph + slot[i * 4 + 3] * fnrows * fncols * bpp;
+}
+
+/* map the glyph atlas at path */
+int pad_gcload(char *path)
+{
+	struct atlas *at;
+	struct stat st;
+	int *slot;
+	int fd, i, empty = 0;
+	at_free();
+	if (!path[0] || (fd = open(path, O_RDONLY)) < 0)
+		return 1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*at)) {
+		close(fd);
+		return 1;
+	}
+	at_mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (at_mem == MAP_FAILED) {
+		at_mem = NULL;
+		return 1;
+	}
+	at_len = st.st_size;
+	at = (void *) at_mem;
+	if (memcmp(at->sig, ATSIG, sizeof(at->sig)) || at->key != at_key() ||
+			at->glen != fnrows * fncols * bpp || at->n & (at->n - 1) ||
+			at->n > 2 * ATMAX || at->cnt >= at->n ||
+			at_len < sizeof(*at) + at->n * 4 * sizeof(int) + (long) at->cnt * at->glen) {
+		at_free();
+		return 1;
+	}
+	/* glyph indices must be in the file and probing must reach an empty slot */
+	slot = (void *) (at_mem + sizeof(*at));
+	for (i = 0; i < at->n; i++) {
+		if (slot[i * 4] == -1)
+			empty++;
+		else if ((unsigned) slot[i * 4 + 3] >= at->cnt)
+			break;
+	}
+	if (i < at->n || !empty) {
+		at_free();
+		return 1;
+	}
+	at_n = at->n;
+	at_glen = at->glen;
+	at_slot = (void *) (at_mem + sizeof(*at));
+	at_glyph = (char *) (at_slot + at_n * 4);
+	return 0;
+}
+
+/* write cached glyphs and printable ASCII characters in fg colours on bg to path */
+void pad_gcsave(char *path, int *fg, int nfg, int bg)
+{
+	int glen = fnrows * fncols * bpp;
+	int cnt = 0, n = 1;
+	int i, j, c;
+	int *slot;
+	char *glyph, *buf, *d, *bits;
+	struct atlas *at;
+	char tmp[1024];
+	long len;
+	int fd;
+	if (!path[0] || !gc_mem)
+		return;
+	while (n < 2 * ATMAX)
+		n <<= 1;
+	len = sizeof(*at) + n * 4 * sizeof(int) + (long) ATMAX * glen;
+	if (!(buf = malloc(len)))
+		return;
+	at = (void *) buf;
+	slot = (void *) (buf + sizeof(*at));
+	glyph = (char *) (slot + n * 4);
+	memset(slot, 0xff, n * 4 * sizeof(int));
+	for (i = 0; i < GCLCNT * gc_len && cnt < ATMAX; i++)
+		if (gc_glyph[i] && (d = at_put(slot, n, glyph, &cnt, gc_glyph[i], gc_fg[i], gc_bg[i])))
+			memcpy(d, gc_mem + i * GCGLEN(gc_rows, gc_cols), glen);
+	for (i = 0; i < nfg; i++) {
+		for (c = '!'; c <= '~' && cnt < ATMAX; c++) {
+			if (at_get(c, fg[i], bg) || !(bits = font_glyph(fonts[0], c)))
+				continue;
+			if ((d = at_put(slot, n, glyph, &cnt, c, fg[i], bg)))
+				bmp2fb(d, fonts[0], bits, fg[i] & FN_C, bg & FN_C);
 		}
 	}
+	for (i = 0; at_mem && i < at_n && cnt < ATMAX; i++) {
+		j = i * 4;
+		if (at_slot[j] != -1 && (d = at_put(slot, n, glyph, &cnt,
+				at_slot[j], at_slot[j + 1], at_slot[j + 2])))
+			memcpy(d, at_glyph + at_slot[j + 3] * at_glen, glen);
+	}
+	memcpy(at->sig, ATSIG, sizeof(at->sig));
+	at->key = at_key();
+	at->n = n;
+	at->cnt = cnt;
+	at->glen = glen;
+	len = sizeof(*at) + n * 4 * sizeof(int) + (long) cnt * glen;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0) {
+		for (i = 0; i < len; i += j)
+			if ((j = write(fd, buf + i, len - i)) <= 0)
+				break;
+		close(fd);
+		if (i < len || rename(tmp, path))
+			unlink(tmp);
+	}
+	free(buf);
 }
 
 static char *ch2fb(int fn, int c, int fg, int bg)
 {
-	static char bits[1024 * 4];
-	char *fbbits;
+	char *fbbits, *bits;
 	if (c < 0 || (c < 128 && (!isprint(c) || isspace(c))))
 		return NULL;
 	if ((fbbits = gc_get(c, fg, bg)))
 		return fbbits;
-	if (!fonts[fn] || font_bitmap(fonts[fn], bits, c))
+	if ((fbbits = at_get(c, fg, bg)))
+		return fbbits;
+	if (!fonts[fn] || !(bits = font_glyph(fonts[fn], c)))
 		return NULL;
 	fbbits = gc_put(c, fg, bg);
-	bmp2fb(fbbits, bits, fg & FN_C, bg & FN_C,
-		font_rows(fonts[fn]), font_cols(fonts[fn]));
+	bmp2fb(fbbits, fonts[fn], bits, fg & FN_C, bg & FN_C);
 	return fbbits;
 }
 
@@ -203,23 +513,48 @@ void pad_border(unsigned c, int wid)
 static int fnsel(int fg, int bg)
 {
 	if ((fg | bg) & FN_B)
-		return fonts[2] ? 2 : 0;
+		return fnload(2) ? 2 : 0;
 	if ((fg | bg) & FN_I)
-		return fonts[1] ? 1 : 0;
+		return fnload(1) ? 1 : 0;
 	return 0;
 }
 
+/* the first of the regular and fallback fonts with character c or -1 */
+static int fnfall(int c)
+{
+	int *ast = fnast[c & 0xff];
+	int i;
+	if (c < 0)
+		return -1;
+	if (c < 0x10000 && fnbmp && fnbmp[c])
+		return fnbmp[c] == 0xff ? -1 : fnbmp[c] - 1;
+	if (c >= 0x10000 && ast[0] == c)
+		return ast[1];
+	for (i = 0; i < FNMAX; i = i ? i + 1 : 3)
+		if (fnload(i) && font_glyph(fonts[i], c))
+			break;
+	if (i == FNMAX)
+		i = -1;
+	if (c < 0x10000 && (fnbmp || (fnbmp = calloc(0x10000, 1))))
+		fnbmp[c] = i < 0 ? 0xff : i + 1;
+	if (c >= 0x10000) {
+		ast[0] = c;
+		ast[1] = i;
+	}
+	return i;
+}
+
 void pad_put(int ch, int r, int c, int fg, int bg)
 {
 	int sr = fnrows * r;
 	int sc = fncols * c;
 	char *bits;
-	int i;
+	int i, fn;
 	if (r >= rows || c >= cols)
 		return;
 	bits = ch2fb(fnsel(fg, bg), ch, fg, bg);
-	if (!bits)
-		bits = ch2fb(0, ch, fg, bg);
+	if (!bits && (fn = fnfall(ch)) >= 0)
+		bits = ch2fb(fn, ch, fg, bg);
 	if (!bits)
 		fb_box(sr, sr + fnrows, sc, sc + fncols, bg & FN_C);
 	else
@@ -227,6 +562,60 @@ void pad_put(int ch, int r, int c, int fg, int bg)
 			fb_cpy(sr + i, sc, bits + (i * fncols * bpp), fncols);
 }
 
+/* replace italic (1) or bold (2) font, keeping other cached glyphs */
+void pad_face(int i, char *path)
+{
+	int j;
+	font_free(fonts[i]);
+	fonts[i] = NULL;
+	fntried[i] = 0;
+	snprintf(fnpath[i], sizeof(fnpath[i]), "%s", path);
+	for (j = 0; j < GCLCNT * gc_len; j++)
+		if ((gc_fg[j] | gc_bg[j]) & (i == 1 ? FN_I : FN_B))
+			gc_glyph[j] = 0;
+	at_free();
+}
+
+/* render a glyph into an unused glyph cache slot, without evicting others */
+void pad_warm(int ch, int fg, int bg)
+{
+	int lst = GCIDX(ch);
+	int fn;
+	if (ch < 0 || !gc_mem || gc_glyph[lst * gc_len + gc_next[lst]])
+		return;
+	if (!ch2fb(fnsel(fg, bg), ch, fg, bg) && (fn = fnfall(ch)) >= 0)
+		ch2fb(fn, ch, fg, bg);
+}
+
+/* move the cells of rows sr to er and columns sc to ec to row dr and column dc */
+void pad_copy(int sr, int er, int sc, int ec, int dr, int dc)
+{
+	int n = (er - sr) * fnrows;
+	int i, j;
+	for (j = 0; j < n; j++) {
+		i = dr > sr ? n - 1 - j : j;
+		memmove(fb_mem(fbroff + dr * fnrows + i) + (fbcoff + dc * fncols) * bpp,
+			fb_mem(fbroff + sr * fnrows + i) + (fbcoff + sc * fncols) * bpp,
+			(ec - sc) * fncols * bpp);
+	}
+}
+
+/* draw w x h pixels of pix (stride bytes per row) at cell (r, c); fill the rest with bg */
+void pad_blit(int r, int c, char *pix, int stride, int w, int h, int bg)
+{
+	int sr = fnrows * r;
+	int sc = fncols * c;
+	int i;
+	if (r >= rows || c >= cols)
+		return;
+	for (i = 0; i < h; i++)
+		fb_cpy(sr + i, sc, pix + i * stride, w);
+	if (w < fncols)
+		fb_box(sr, sr + h, sc + w, sc + fncols, bg & FN_C);
+	if (h < fnrows)
+		fb_box(sr + h, sr + fnrows, sc, sc + fncols, bg & FN_C);
+}
+
 void pad_fill(int sr, int er, int sc, int ec, int c)
 {
 	int fber = er >= 0 ? er * fnrows : fbrows;
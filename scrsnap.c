@@ -2,44 +2,286 @@
 #include <string.h>
 #include "draw.h"
 
-#define NSCRS		128
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
 
-static void *scrs[NSCRS];
+/*
+ * Screen rows are saved run-length encoded: each record starts with a
+ * 16-bit header; if its highest bit is set, the next pixel is repeated
+ * (header & RUNMAX) times, otherwise header pixels follow.
+ */
+#define RUN		0x8000
+#define RUNMAX		0x7fff
 
-void scr_snap(int idx)
+struct scr {
+	char **rows;		/* encoded rows; equal adjacent rows share one */
+	unsigned long long *hash;	/* row hashes */
+	int n;			/* number of rows */
+	int rowsz;		/* bytes per framebuffer row */
+	long mem;		/* allocated bytes */
+	int pin;		/* not evicted */
+	unsigned long used;	/* last use for LRU eviction */
+};
+
+static struct scr **scrs;	/* saved screens of terminals */
+static int nscrs;
+static long scr_max;		/* memory limit of screens that are not pinned */
+static unsigned long scr_clock;
+
+static char *rle_buf;		/* encoding buffer */
+static int rle_sz;
+
+static unsigned long long rowhash(char *s, int n)
 {
-	int rowsz = FBM_BPP(fb_mode()) * fb_cols();
+	unsigned long long h = 0xcbf29ce484222325ull;
+	unsigned long long v;
 	int i;
-	if (idx < NSCRS && !scrs[idx])
-		scrs[idx] = malloc(fb_rows() * rowsz);
-	if (idx < NSCRS && scrs[idx])
-		for (i = 0; i < fb_rows(); i++)
-			memcpy(scrs[idx] + i * rowsz, fb_mem(i), rowsz);
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&v, s + i, 8);
+		h = (h ^ v) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for (; i < n; i++)
+		h = (h ^ (unsigned char) s[i]) * 0x100000001b3ull;
+	return h;
+}
+
+static char *rle_hdr(char *d, int n)
+{
+	d[0] = n & 0xff;
+	d[1] = (n >> 8) & 0xff;
+	return d + 2;
+}
+
+/* encode a row of n pixels; returns a new buffer */
+static char *rle_enc(char *s, int n, int bpp)
+{
+	char *d, *r;
+	int i = 0, j;
+	if (rle_sz < n * bpp + 2 * n) {
+		free(rle_buf);
+		rle_sz = n * bpp + 2 * n;
+		if (!(rle_buf = malloc(rle_sz))) {
+			rle_sz = 0;
+			return NULL;
+		}
+	}
+	d = rle_buf;
+	while (i < n) {
+		for (j = i + 1; j < n && j - i < RUNMAX; j++)
+			if (memcmp(s + i * bpp, s + j * bpp, bpp))
+				break;
+		if (j - i > 1) {
+			d = rle_hdr(d, RUN | (j - i));
+			memcpy(d, s + i * bpp, bpp);
+			d += bpp;
+			i = j;
+			continue;
+		}
+		/* literal pixels up to the next run */
+		for (j = i + 1; j < n && j - i < RUNMAX; j++)
+			if (j + 1 < n && !memcmp(s + j * bpp, s + (j + 1) * bpp, bpp))
+				break;
+		d = rle_hdr(d, j - i);
+		memcpy(d, s + i * bpp, (j - i) * bpp);
+		d += (j - i) * bpp;
+		i = j;
+	}
+	if ((r = malloc(d - rle_buf)))
+		memcpy(r, rle_buf, d - rle_buf);
+	return r;
+}
+
+/* decode a row of rowsz bytes into d */
+static void rle_dec(char *d, char *s, int rowsz, int bpp)
+{
+	char *e = d + rowsz;
+	int h, n, k;
+	while (d < e) {
+		h = (unsigned char) s[0] | ((unsigned char) s[1] << 8);
+		n = (h & RUNMAX) * bpp;
+		s += 2;
+		if (h & RUN) {
+			memcpy(d, s, bpp);
+			for (k = bpp; k < n; k <<= 1)
+				memcpy(d + k, d, MIN(k, n - k));
+			s += bpp;
+		} else {
+			memcpy(d, s, n);
+			s += n;
+		}
+		d += n;
+	}
+}
+
+/* the size of an encoded row */
+static int rle_len(char *s, int rowsz, int bpp)
+{
+	char *beg = s;
+	int h, n = 0;
+	while (n < rowsz) {
+		h = (unsigned char) s[0] | ((unsigned char) s[1] << 8);
+		n += (h & RUNMAX) * bpp;
+		s += 2 + (h & RUN ? bpp : (h & RUNMAX) * bpp);
+	}
+	return s - beg;
+}
+
+/* free the rows of old not used in rows */
+static void scr_rowsfree(char **old, char **rows, int n)
+{
+	int i, j, used;
+	for (i = 0; i < n; i = j) {
+		used = 0;
+		for (j = i; j < n && old[j] == old[i]; j++)
+			used = used || (rows && rows[j] == old[j]);
+		if (!used)
+			free(old[i]);
+	}
 }
 
 void scr_free(int idx)
 {
-	if (idx < NSCRS) {
+	if (idx < nscrs && scrs[idx]) {
+		scr_rowsfree(scrs[idx]->rows, NULL, scrs[idx]->n);
+		free(scrs[idx]->rows);
+		free(scrs[idx]->hash);
 		free(scrs[idx]);
 		scrs[idx] = NULL;
 	}
 }
 
-int scr_load(int idx)
+/* free the least recently used screens that are not pinned, beyond the limit */
+static void scr_evict(void)
 {
-	int rowsz = FBM_BPP(fb_mode()) * fb_cols();
+	long mem;
+	int i, lru;
+	while (1) {
+		mem = 0;
+		lru = -1;
+		for (i = 0; i < nscrs; i++) {
+			if (!scrs[i] || scrs[i]->pin)
+				continue;
+			mem += scrs[i]->mem;
+			if (lru < 0 || scrs[i]->used < scrs[lru]->used)
+				lru = i;
+		}
+		if (mem <= scr_max)
+			break;
+		scr_free(lru);
+	}
+}
+
+/* allocated bytes; only for screens that are not pinned unless all is set */
+long scr_mem(int all)
+{
+	long mem = 0;
 	int i;
-	if (idx < NSCRS && scrs[idx]) {
-		for (i = 0; i < fb_rows(); i++)
-			memcpy(fb_mem(i), scrs[idx] + i * rowsz, rowsz);
-		return 0;
+	for (i = 0; i < nscrs; i++)
+		if (scrs[i] && (all || !scrs[i]->pin))
+			mem += scrs[i]->mem;
+	return mem;
+}
+
+/* set the memory limit of the screens that are not pinned */
+void scr_limit(long mem)
+{
+	scr_max = mem;
+	scr_evict();
+}
+
+/* save the framebuffer; only rows changed since the last snapshot are encoded */
+/* + pin: do not free the screen when exceeding the memory limit */
+void scr_snap(int idx, int pin)
+{
+	int bpp = FBM_BPP(fb_mode());
+	int rowsz = bpp * fb_cols();
+	int n = fb_rows();
+	struct scr *scr;
+	char **rows;
+	unsigned long long *hash;
+	int i;
+	if (idx >= nscrs) {
+		int n = MAX(idx + 1, nscrs * 2);
+		struct scr **scrs_new = realloc(scrs, n * sizeof(scrs[0]));
+		if (!scrs_new)
+			return;
+		memset(scrs_new + nscrs, 0, (n - nscrs) * sizeof(scrs[0]));
+		scrs = scrs_new;
+		nscrs = n;
+	}
+	if (scrs[idx] && (scrs[idx]->n != n || scrs[idx]->rowsz != rowsz))
+		scr_free(idx);
+	if (!scrs[idx] && (scrs[idx] = malloc(sizeof(*scr))))
+		memset(scrs[idx], 0, sizeof(*scr));
+	if (!(scr = scrs[idx]))
+		return;
+	rows = malloc(n * sizeof(rows[0]));
+	hash = malloc(n * sizeof(hash[0]));
+	if (!rows || !hash) {
+		free(rows);
+		free(hash);
+		scr_free(idx);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		char **old = scr->rows;
+		hash[i] = rowhash(fb_mem(i), rowsz);
+		/* rows sharing an encoding should remain adjacent */
+		if (old && hash[i] == scr->hash[i] &&
+				(!i || old[i] != old[i - 1] || rows[i - 1] == old[i - 1]))
+			rows[i] = old[i];
+		else if (i && hash[i] == hash[i - 1])
+			rows[i] = rows[i - 1];
+		else if (!(rows[i] = rle_enc(fb_mem(i), fb_cols(), bpp)))
+			break;
 	}
-	return 1;
+	if (i < n)
+		memset(rows + i, 0, (n - i) * sizeof(rows[0]));
+	if (scr->rows)
+		scr_rowsfree(scr->rows, rows, scr->n);
+	free(scr->rows);
+	free(scr->hash);
+	scr->rows = rows;
+	scr->hash = hash;
+	scr->n = i;
+	scr->rowsz = rowsz;
+	if (i < n) {
+		scr_free(idx);
+		return;
+	}
+	scr->mem = sizeof(*scr) + n * (sizeof(rows[0]) + sizeof(hash[0]));
+	for (i = 0; i < n; i++)
+		if (!i || rows[i] != rows[i - 1])
+			scr->mem += rle_len(rows[i], rowsz, bpp);
+	scr->pin = pin;
+	scr->used = ++scr_clock;
+	scr_evict();
+}
+
+/* load the screen of idx; cur is the snapshot on the screen or -1 */
+int scr_load(int idx, int cur)
+{
+	int bpp = FBM_BPP(fb_mode());
+	struct scr *scr = idx < nscrs ? scrs[idx] : NULL;
+	struct scr *now = cur >= 0 && cur < nscrs ? scrs[cur] : NULL;
+	int i;
+	if (!scr || scr->n != fb_rows() || scr->rowsz != bpp * fb_cols())
+		return 1;
+	if (now && (now->n != scr->n || now->rowsz != scr->rowsz))
+		now = NULL;
+	for (i = 0; i < scr->n; i++)
+		if (!now || now->hash[i] != scr->hash[i])
+			rle_dec(fb_mem(i), scr->rows[i], scr->rowsz, bpp);
+	scr->used = ++scr_clock;
+	return 0;
 }
 
 void scr_done(void)
 {
 	int i;
-	for (i = 0; i < NSCRS; i++)
-		free(scrs[i]);
+	for (i = 0; i < nscrs; i++)
+		scr_free(i);
+	free(scrs);
+	free(rle_buf);
 }
@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "fbpad.h"
 
@@ -24,13 +25,15 @@
 #define MODE_WRAPREADY		0x200
 #define MODE_CLR8		0x400	/* colours 0-7 */
 
-/* encoding of term->scrfn entries */
-#define FN_MK(fg, bg)		((fg) | ((bg) << 14))
-#define FN_FG(c)		((c) & 0x3fff)
-#define FN_BG(c)		(((c) >> 14) & 0x3fff)
+/* attributes of term->scrfn entries: fg colour with FN_B and FN_I, and bg colour */
+#define AT_FN(t, a)		((t)->attr[(a) * 2])
+#define AT_BG(t, a)		((t)->attr[(a) * 2 + 1])
+#define AT_MAX			(1 << 16)	/* maximum number of attributes */
+#define AT_HASH(fn, bg, n)	(((unsigned) (fn) * 0x9e3779b1u ^ (unsigned) (bg)) & ((n) - 1))
+#define FN_FG(c)		((c) & ~(FN_B | FN_I))
 #define FN_M(c)			((c) & (FN_B | FN_I))
-/* fg or bg colours: colour index or 12-bit RGB */
-#define XG_RGB			0x1000	/* 12-bit RGB */
+/* fg or bg colours: colour index or 24-bit RGB */
+#define XG_RGB			0x1000000	/* 24-bit RGB */
 #define XG_FG			0x0100	/* index of fg colour */
 #define XG_BG			0x0101	/* index of bg colour */
 
@@ -46,13 +49,35 @@ struct term_state {
 
 struct term {
 	char recv[256];			/* receive buffer */
-	char send[256];			/* send buffer */
+	char *send;			/* output queue */
 	int recv_n;			/* number of buffered bytes in recv[] */
-	int send_n;			/* number of buffered bytes in send[] */
+	int send_n;			/* end of queued bytes in send[] */
+	int send_pos;			/* the first unwritten byte in send[] */
+	int send_sz;			/* size of send[] */
 	int *scrch;			/* screen characters */
-	int *scrfn;			/* screen foreground/background colour */
-	int *hist;			/* scrolling history */
+	unsigned short *scrfn;		/* screen attributes; indices of attr[] */
+	int *attr;			/* interned attributes (AT_FN and AT_BG) */
+	int *attr_idx;			/* hash table of attr[] indices plus one */
+	int attr_n;			/* number of attributes in attr[] */
+	int attr_sz;			/* the size of attr[] */
+	int attr_last;			/* the last attribute returned by attr_get() */
+	int *hist;			/* scrolling history; allocated when needed */
 	int *dirty;			/* changed rows in lazy mode */
+	char *mem;			/* the arena holding dirty, scrch, scrfn, and hist */
+	long mem_sz;			/* the size of mem[] */
+	int mrows, mcols;		/* the geometry mem[] is laid out for */
+	char *altmem;			/* alternate screen memory; allocated when needed */
+	int *altch;			/* characters of the inactive screen */
+	unsigned short *altfn;		/* attributes of the inactive screen */
+	int alt;			/* the alternate screen is active */
+	long sync;			/* synchronized output deadline (term_ms()) or zero */
+	int lastch;			/* the last printed character for REP */
+	char *str;			/* the body of the DCS or APC string being received */
+	int str_n;			/* the length of str[] or -1 if too long */
+	int str_sz;			/* the size of str[] */
+	int str_kind;			/* 'P' or '_' while receiving a DCS or APC string */
+	int str_more;			/* the length of an unfinished kitty image in str[] */
+	struct sixel *six;		/* the sixel image being decoded */
 	struct term_state cur, sav;	/* terminal saved state */
 	int fd;				/* terminal file descriptor */
 	int hrow;			/* the next history row in hist[] */
@@ -62,9 +87,11 @@ struct term {
 	int top, bot;			/* terminal scrolling region */
 	int rows, cols;
 	int signal;			/* send SIGUSR1 and SIGUSR2 */
+	struct term *next;		/* the next terminal in term_all */
 };
 
 static struct term *term;
+static struct term *term_all;		/* all allocated terminals */
 static int lazy;
 static int rows, cols;
 static int row, col;
@@ -75,18 +102,17 @@ static int visible;
 
 static int clrmap_rgb(int r, int g, int b)
 {
-	return XG_RGB | ((r & 0xf0) << 4 | (g & 0xf0) | (b >> 4));
+	return XG_RGB | ((r & 0xff) << 16) | ((g & 0xff) << 8) | (b & 0xff);
 }
 
 static int clrmap_rgbdec(int c)
 {
-	int r = (c >> 4) & 0xf0;
-	int g = c & 0xf0;
-	int b = (c & 0x0f) << 4;
-	return (r << 16) | (g << 8) | b;
+	return c & 0xffffff;
 }
 
-static int clrmap(int c)
+static int clrlut[258];		/* RGB of colour indices, XG_FG, and XG_BG */
+
+static int clrcalc(int c)
 {
 	int g = (c - 232) * 10 + 8;
 	if (c < 16)
@@ -109,31 +135,140 @@ static int clrmap(int c)
 	return (g << 16) | (g << 8) | g;
 }
 
+static int clrmap(int c)
+{
+	return c < LEN(clrlut) ? clrlut[c] : clrmap_rgbdec(c);
+}
+
+/* update the colour table after loading the configuration */
+void term_colors(void)
+{
+	int i;
+	for (i = 0; i < LEN(clrlut); i++)
+		clrlut[i] = clrcalc(i);
+}
+
+/* attribute interning */
+
+/* resize attr[] and rebuild its hash table */
+static int attr_alloc(struct term *t, int sz)
+{
+	int *attr = realloc(t->attr, sz * 2 * sizeof(attr[0]));
+	int *idx = malloc(sz * 2 * sizeof(idx[0]));
+	int i, j;
+	if (attr)
+		t->attr = attr;
+	if (!attr || !idx) {
+		free(idx);
+		return 1;
+	}
+	memset(idx, 0, sz * 2 * sizeof(idx[0]));
+	for (i = 0; i < t->attr_n; i++) {
+		j = AT_HASH(AT_FN(t, i), AT_BG(t, i), sz * 2);
+		while (idx[j])
+			j = (j + 1) & (sz * 2 - 1);
+		idx[j] = i + 1;
+	}
+	free(t->attr_idx);
+	t->attr_idx = idx;
+	t->attr_sz = sz;
+	return 0;
+}
+
+/* forget all attributes but the zeroth; black on black, as in zeroed cells */
+static void attr_reset(struct term *t)
+{
+	t->attr_n = 1;
+	t->attr_last = 0;
+	AT_FN(t, 0) = 0;
+	AT_BG(t, 0) = 0;
+	attr_alloc(t, t->attr_sz);
+}
+
+/* drop the attributes not used on the screen */
+static int attr_compact(void)
+{
+	unsigned short *map = malloc(term->attr_n * sizeof(map[0]));
+	unsigned short *fn;
+	int cnt = term->rows * term->cols;
+	int n = 1;
+	int i, a;
+	if (!map)
+		return 1;
+	memset(map, 0xff, term->attr_n * sizeof(map[0]));
+	map[0] = 0;
+	/* the cells of both screens */
+	for (i = 0; i < (term->altmem ? cnt * 2 : cnt); i++) {
+		fn = i < cnt ? term->scrfn + i : term->altfn + i - cnt;
+		a = *fn;
+		if (map[a] == 0xffff) {
+			AT_FN(term, n) = AT_FN(term, a);
+			AT_BG(term, n) = AT_BG(term, a);
+			map[a] = n++;
+		}
+		*fn = map[a];
+	}
+	free(map);
+	term->attr_n = n;
+	term->attr_last = 0;
+	return attr_alloc(term, term->attr_sz) || n == term->attr_sz;
+}
+
+/* the index of attribute (fn, bg) in term->attr[] */
+static int attr_get(int fn, int bg)
+{
+	int a = term->attr_last;
+	int i;
+	if (AT_FN(term, a) == fn && AT_BG(term, a) == bg)
+		return a;
+	i = AT_HASH(fn, bg, term->attr_sz * 2);
+	while ((a = term->attr_idx[i] - 1) >= 0) {
+		if (AT_FN(term, a) == fn && AT_BG(term, a) == bg)
+			return term->attr_last = a;
+		i = (i + 1) & (term->attr_sz * 2 - 1);
+	}
+	if (term->attr_n == term->attr_sz) {
+		if (term->attr_sz < AT_MAX ? attr_alloc(term, term->attr_sz * 2) : attr_compact())
+			return 0;
+		return attr_get(fn, bg);
+	}
+	a = term->attr_n++;
+	AT_FN(term, a) = fn;
+	AT_BG(term, a) = bg;
+	term->attr_idx[i] = a + 1;
+	return term->attr_last = a;
+}
+
 /* low level drawing and lazy updating */
 
 static int color(void)
 {
-	int c = mode & ATTR_REV ? FN_MK(bg, fg) : FN_MK(fg, bg);
+	int fn = mode & ATTR_REV ? bg : fg;
 	if (mode & ATTR_BOLD)
-		c |= FN_B;
+		fn |= FN_B;
 	if (mode & ATTR_ITALIC)
-		c |= FN_I;
-	return c;
+		fn |= FN_I;
+	return attr_get(fn, mode & ATTR_REV ? fg : bg);
 }
 
 /* assumes visible && !lazy */
 static void _draw_pos(int r, int c, int cursor)
 {
 	int i = OFFSET(r, c);
-	int fg = clrmap(FN_FG(term->scrfn[i]));
-	int bg = clrmap(FN_BG(term->scrfn[i]));
+	int fn = AT_FN(term, term->scrfn[i]);
+	int fg = clrmap(FN_FG(fn));
+	int bg = clrmap(AT_BG(term, term->scrfn[i]));
 	int cfg = conf_cursorfg();
 	int cbg = conf_cursorbg();
+	if (term->scrch[i] & IMGCHAR) {
+		img_cell(term->scrch[i], r, c, bg);
+		return;
+	}
 	if (cursor && mode & MODE_CURSOR) {
-		fg = cfg >= 0 ? cfg : clrmap(FN_BG(term->scrfn[i]));
-		bg = cbg >= 0 ? cbg : clrmap(FN_FG(term->scrfn[i]));
+		fg = cfg >= 0 ? cfg : clrmap(AT_BG(term, term->scrfn[i]));
+		bg = cbg >= 0 ? cbg : clrmap(FN_FG(fn));
 	}
-	pad_put(term->scrch[i], r, c, FN_M(term->scrfn[i]) | fg, bg);
+	pad_put(term->scrch[i], r, c, FN_M(fn) | fg, bg);
 }
 
 /* assumes visible && !lazy */
@@ -145,7 +280,7 @@ static void _draw_row(int r)
 	int i;
 	/* call pad_fill() only once for blank columns with identical backgrounds */
 	for (i = 0; i < cols; i++) {
-		cbg = FN_BG(term->scrfn[OFFSET(r, i)]);
+		cbg = AT_BG(term, term->scrfn[OFFSET(r, i)]);
 		cch = scrch[OFFSET(r, i)] ? scrch[OFFSET(r, i)] : ' ';
 		if (fsc >= 0 && (cbg != fbg || cch != ' ')) {
 			pad_fill(r, r + 1, fsc, i, clrmap(fbg));
@@ -223,11 +358,12 @@ static void lazy_flush(void)
 
 static void screen_reset(int i, int n)
 {
+	int a = attr_get(fg, bg);
 	int c;
 	candraw(i / cols, (i + n) / cols);
 	memset(term->scrch + i, 0, n * sizeof(*term->scrch));
 	for (c = 0; c < n; c++)
-		term->scrfn[i + c] = FN_MK(fg, bg);
+		term->scrfn[i + c] = a;
 }
 
 static void screen_move(int dst, int src, int n)
@@ -242,6 +378,9 @@ static void screen_move(int dst, int src, int n)
 /* terminal input buffering */
 
 #define PTYLEN			(1 << 16)
+#define PTYCHUNK		(1 << 12)	/* bytes read from the terminal at once */
+#define PTYUS			8000		/* time budget of term_read() */
+#define SYNCMS			150		/* the timeout of synchronized output */
 #define pty_mark()		(ptyreq = ptycur)
 #define pty_back()		(ptycur = ptyreq)
 #define pty_left()		(ptylen - ptycur)
@@ -250,13 +389,40 @@ static char ptybuf[PTYLEN];		/* always emptied in term_read() */
 static int ptylen;			/* buffer length */
 static int ptycur;			/* current offset */
 static int ptyreq;			/* the beginning of the last request */
+static int ptyrem;			/* bytes term_read() may still read */
+static struct timespec ptydl;		/* term_read() deadline */
+
+static void pty_deadline(int us)
+{
+	clock_gettime(CLOCK_MONOTONIC, &ptydl);
+	ptydl.tv_nsec += us * 1000l;
+	ptydl.tv_sec += ptydl.tv_nsec / 1000000000l;
+	ptydl.tv_nsec %= 1000000000l;
+}
+
+/* milliseconds since an arbitrary point */
+static long term_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000l + ts.tv_nsec / 1000000;
+}
+
+static int pty_late(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec > ptydl.tv_sec ||
+		(ts.tv_sec == ptydl.tv_sec && ts.tv_nsec >= ptydl.tv_nsec);
+}
 
-static int pty_wait(int out, int us)
+/* keys are waiting on stdin */
+static int pty_keys(void)
 {
 	struct pollfd ufds[1];
-	ufds[0].fd = term->fd;
-	ufds[0].events = out ? POLLOUT : POLLIN;
-	return poll(ufds, 1, us) <= 0;
+	ufds[0].fd = 0;
+	ufds[0].events = POLLIN;
+	return poll(ufds, 1, 0) > 0 && ufds[0].revents & POLLIN;
 }
 
 static int pty_read(void)
@@ -271,8 +437,17 @@ static int pty_read(void)
 	ptycur = ptyreq < ptycur ? ptycur - ptyreq : 0;
 	ptylen = ptyreq < ptylen ? ptylen - ptyreq : 0;
 	ptyreq = 0;
-	while ((nr = read(term->fd, ptybuf + ptylen, PTYLEN - ptylen)) > 0)
+	/* stop at the budget or deadline; an unfinished request resumes in the next */
+	/* + round, if it fits in recv[] (long OSC strings are finished instead) */
+	if (ptylen < sizeof(term->recv) && (ptyrem <= 0 || pty_late()))
+		return -1;
+	/* yield to the keyboard between requests, so that c-c is handled promptly */
+	if (!ptylen && pty_keys())
+		return -1;
+	if ((nr = read(term->fd, ptybuf + ptylen, MIN(PTYCHUNK, PTYLEN - ptylen))) > 0) {
 		ptylen += nr;
+		ptyrem -= nr;
+	}
 	return ptycur < ptylen ? (unsigned char) ptybuf[ptycur++] : -1;
 }
 
@@ -291,13 +466,157 @@ static int pty_save(char *buf, int size)
 	return len;
 }
 
+/* terminal arenas */
+
+#define AR_ALIGN(n)		(((n) + 7) & ~7l)
+#define AR_POOL			8	/* maximum number of spare arenas */
+
+static char *ar_pool[AR_POOL];	/* arenas of freed terminals */
+static long ar_poolsz[AR_POOL];
+
+/* the size of an arena for r rows and c columns, with history if hist is set */
+static long ar_size(int r, int c, int hist)
+{
+	return AR_ALIGN(r * sizeof(int)) + AR_ALIGN((long) r * c * sizeof(int)) +
+		AR_ALIGN((long) r * c * sizeof(short)) +
+		(hist ? NHIST * c * sizeof(int) : 0);
+}
+
+/* point the buffers of t into its arena: [dirty | scrch | scrfn | hist] */
+static void ar_set(struct term *t, int hist)
+{
+	char *m = t->mem;
+	t->dirty = (void *) m;
+	m += AR_ALIGN(t->mrows * sizeof(int));
+	*(t->alt ? &t->altch : &t->scrch) = (void *) m;
+	m += AR_ALIGN((long) t->mrows * t->mcols * sizeof(int));
+	*(t->alt ? &t->altfn : &t->scrfn) = (void *) m;
+	m += AR_ALIGN((long) t->mrows * t->mcols * sizeof(short));
+	t->hist = hist ? (void *) m : NULL;
+}
+
+/* allocate an arena of at least sz bytes, preferring spare ones */
+static char *ar_get(long sz, long *got)
+{
+	int i;
+	for (i = 0; i < AR_POOL; i++) {
+		if (ar_pool[i] && ar_poolsz[i] >= sz) {
+			char *m = ar_pool[i];
+			*got = ar_poolsz[i];
+			ar_pool[i] = NULL;
+			return m;
+		}
+	}
+	*got = sz;
+	return malloc(sz);
+}
+
+static void ar_put(char *m, long sz)
+{
+	int i;
+	for (i = 0; i < AR_POOL && m; i++) {
+		if (!ar_pool[i]) {
+			ar_pool[i] = m;
+			ar_poolsz[i] = sz;
+			return;
+		}
+	}
+	free(m);
+}
+
+/* the size of spare arenas; they are freed if drop is set */
+long term_spare(int drop)
+{
+	long mem = 0;
+	int i;
+	for (i = 0; i < AR_POOL; i++) {
+		if (ar_pool[i]) {
+			mem += ar_poolsz[i];
+			if (drop) {
+				free(ar_pool[i]);
+				ar_pool[i] = NULL;
+			}
+		}
+	}
+	return mem;
+}
+
+/* add (or remove if n is zero) the scrolling history of t */
+static int ar_hist(struct term *t, int n)
+{
+	long sz = ar_size(t->mrows, t->mcols, n);
+	char *m;
+	if (!n == !t->hist)
+		return 0;
+	if (sz > t->mem_sz || !n) {
+		if (!(m = realloc(t->mem, sz)))
+			return 1;
+		t->mem = m;
+		t->mem_sz = sz;
+	}
+	ar_set(t, n);
+	if (n)
+		memset(t->hist, 0, NHIST * t->mcols * sizeof(t->hist[0]));
+	t->hrow = 0;
+	return 0;
+}
+
+/* the alternate screen */
+
+#define ALT_SZ(t)		((long) (t)->mrows * (t)->mcols * (sizeof(int) + sizeof(short)))
+
+/* exchange the screen and the inactive screen */
+static void alt_swap(struct term *t)
+{
+	int *ch = t->scrch;
+	unsigned short *fn = t->scrfn;
+	t->scrch = t->altch;
+	t->scrfn = t->altfn;
+	t->altch = ch;
+	t->altfn = fn;
+	t->alt = !t->alt;
+}
+
+/* (re)allocate the alternate screen for the geometry of the arena */
+static int alt_alloc(struct term *t)
+{
+	char *m = malloc(ALT_SZ(t));
+	int *ch = (void *) m;
+	unsigned short *fn = (void *) (m + (long) t->mrows * t->mcols * sizeof(int));
+	int n = t->rows * t->cols;
+	if (!m)
+		return 1;
+	memset(m, 0, ALT_SZ(t));
+	if (t->altmem) {
+		memcpy(ch, t->alt ? t->scrch : t->altch, n * sizeof(ch[0]));
+		memcpy(fn, t->alt ? t->scrfn : t->altfn, n * sizeof(fn[0]));
+	}
+	free(t->altmem);
+	t->altmem = m;
+	*(t->alt ? &t->scrch : &t->altch) = ch;
+	*(t->alt ? &t->scrfn : &t->altfn) = fn;
+	return 0;
+}
+
+static void alt_free(struct term *t)
+{
+	if (t->alt)
+		alt_swap(t);
+	free(t->altmem);
+	t->altmem = NULL;
+	t->altch = NULL;
+	t->altfn = NULL;
+}
+
 /* term interface functions */
 
 static void term_zero(struct term *term)
 {
 	int r = term->rows, c = term->cols;
+	alt_free(term);
 	memset(term->scrch, 0, r * c * sizeof(term->scrch[0]));
-	memset(term->hist, 0, NHIST * c * sizeof(term->hist[0]));
+	if (term->hist)
+		memset(term->hist, 0, NHIST * term->mcols * sizeof(term->hist[0]));
 	memset(term->scrfn, 0, r * c * sizeof(term->scrfn[0]));
 	memset(term->dirty, 0, r * sizeof(term->dirty[0]));
 	memset(&term->cur, 0, sizeof(term->cur));
@@ -310,55 +629,72 @@ static void term_zero(struct term *term)
 	term->top = 0;
 	term->bot = 0;
 	term->signal = 0;
+	term->sync = 0;
+	term->lastch = 0;
+	term->str_kind = 0;
+	term->str_n = 0;
+	term->str_more = 0;
+	img_sixfree(term->six);
+	term->six = NULL;
 	term->send_n = 0;
+	term->send_pos = 0;
 	term->recv_n = 0;
+	attr_reset(term);
 }
 
 static int term_resize(struct term *term, int r, int c)
 {
 	if (r == term->rows && c == term->cols)
 		return 1;
-	if (r > term->rows || c > term->cols) {
-		int *scrch = malloc(r * c * sizeof(scrch[0]));
-		int *scrfn = malloc(r * c * sizeof(scrfn[0]));
-		int *hist = malloc(NHIST * c * sizeof(hist[0]));
-		int *dirty = malloc(r * sizeof(dirty[0]));
-		int rc = MIN(r * c, term->rows * term->cols);
-		if (!scrch || !scrfn || !hist || !dirty) {
-			free(scrch);
-			free(scrfn);
-			free(hist);
-			free(dirty);
+	/* a new arena, if the old one is too small; history rows are kept */
+	if (r > term->mrows || c > term->mcols) {
+		int mr = MAX(r, term->mrows);
+		int mc = MAX(c, term->mcols);
+		int hist = term->hist != NULL;
+		struct term old = *term;
+		int i;
+		if (!(term->mem = ar_get(ar_size(mr, mc, hist), &term->mem_sz))) {
+			*term = old;
 			return 1;
 		}
-		memcpy(scrch, term->scrch, rc * sizeof(scrch[0]));
-		memcpy(scrfn, term->scrfn, rc * sizeof(scrfn[0]));
-		memset(dirty, 0, r * sizeof(dirty[0]));
-		memset(hist, 0, NHIST * c * sizeof(hist[0]));
-		free(term->scrch);
-		free(term->scrfn);
-		free(term->hist);
-		free(term->dirty);
-		term->scrch = scrch;
-		term->scrfn = scrfn;
-		term->hist = hist;
-		term->dirty = dirty;
+		term->mrows = mr;
+		term->mcols = mc;
+		ar_set(term, hist);
+		memset(term->dirty, 0, mr * sizeof(term->dirty[0]));
+		if (old.mem) {
+			int rc = old.rows * old.cols;
+			memcpy(term->alt ? term->altch : term->scrch,
+				old.alt ? old.altch : old.scrch, rc * sizeof(term->scrch[0]));
+			memcpy(term->alt ? term->altfn : term->scrfn,
+				old.alt ? old.altfn : old.scrfn, rc * sizeof(term->scrfn[0]));
+		}
+		if (hist) {
+			memset(term->hist, 0, NHIST * mc * sizeof(term->hist[0]));
+			for (i = 0; i < NHIST; i++)
+				memcpy(term->hist + i * mc, old.hist + i * old.mcols,
+					old.mcols * sizeof(term->hist[0]));
+		}
+		ar_put(old.mem, old.mem_sz);
+		if (term->altmem && alt_alloc(term))
+			alt_free(term);
 	}
 	term->rows = r;
 	term->cols = c;
 	return 0;
 }
 
-static void resizeupdate(int or, int oc, int nr,  int nc)
+/* move the cells of a screen to the new geometry, skipping its first dr rows */
+static void resizeupdate(int *scrch, unsigned short *scrfn, int dr,
+		int or, int oc, int nr,  int nc)
 {
-	int dr = row >= nr ? row - nr + 1 : 0;
 	int dst = nc <= oc ? 0 : nr * nc - 1;
+	int a = color();
 	while (dst >= 0 && dst < nr * nc) {
 		int r = dst / nc;
 		int c = dst % nc;
 		int src = dr + r < or && c < oc ? (dr + r) * oc + c : -1;
-		term->scrch[dst] = src >= 0 ? term->scrch[src] : 0;
-		term->scrfn[dst] = src >= 0 ? term->scrfn[src] : color();
+		scrch[dst] = src >= 0 ? scrch[src] : 0;
+		scrfn[dst] = src >= 0 ? scrfn[src] : a;
 		dst = nc <= oc ? dst + 1 : dst - 1;
 	}
 }
@@ -380,7 +716,10 @@ static void term_resizeupdate(void)
 		rows = term->rows;
 		cols = term->cols;
 		if (term->fd)
-			resizeupdate(r, c, pad_rows(), pad_cols());
+			resizeupdate(term->scrch, term->scrfn, MAX(0, row - rows + 1),
+				r, c, rows, cols);
+		if (term->fd && term->altmem)
+			resizeupdate(term->altch, term->altfn, 0, r, c, rows, cols);
 		if (term->fd)
 			tio_setsize(term->fd);
 		if (bot == r)
@@ -398,20 +737,30 @@ struct term *term_make(void)
 	if (!term)
 		return NULL;
 	memset(term, 0, sizeof(*term));
-	if (term_resize(term, pad_rows(), pad_cols())) {
+	if (term_resize(term, pad_rows(), pad_cols()) || attr_alloc(term, 64)) {
 		term_free(term);
 		return NULL;
 	}
 	term_zero(term);
+	term->next = term_all;
+	term_all = term;
 	return term;
 }
 
 void term_free(struct term *term)
 {
-	free(term->scrch);
-	free(term->hist);
-	free(term->scrfn);
-	free(term->dirty);
+	struct term **t = &term_all;
+	while (*t && *t != term)
+		t = &(*t)->next;
+	if (*t)
+		*t = term->next;
+	ar_put(term->mem, term->mem_sz);
+	free(term->altmem);
+	free(term->str);
+	img_sixfree(term->six);
+	free(term->send);
+	free(term->attr);
+	free(term->attr_idx);
 	free(term);
 }
 
@@ -420,30 +769,46 @@ int term_fd(struct term *term)
 	return term->fd;
 }
 
-static int term_flush(void)
+/* the number of bytes waiting to be written to the terminal */
+int term_sendq(struct term *term)
 {
-	int nr;
-	if (term->send_n && (nr = write(term->fd, term->send, term->send_n)) > 0) {
-		if (term->send_n > nr)
-			memmove(term->send, term->send + nr, term->send_n - nr);
-		term->send_n -= nr;
+	return term->send_n - term->send_pos;
+}
+
+/* write as much of the output queue as the terminal accepts */
+void term_flush(struct term *term)
+{
+	int nw;
+	if (term->send_pos < term->send_n && (nw = write(term->fd,
+			term->send + term->send_pos, term->send_n - term->send_pos)) > 0)
+		term->send_pos += nw;
+	if (term->send_pos == term->send_n) {
+		term->send_pos = 0;
+		term->send_n = 0;
 	}
-	return term->send_n == sizeof(term->send);
 }
 
+/* queue the given bytes; they are written when the terminal is writable */
 void term_send(char *s, int n)
 {
-	int i;
 	if (!term || !term->fd)
 		return;
-	for (i = 0; i < 4 && n > 0 && !pty_wait(1, 50); i++) {
-		int cp = MIN(n, LEN(term->send) - term->send_n);
-		memcpy(term->send + term->send_n, s, cp);
-		term->send_n += cp;
-		s += cp;
-		n -= cp;
-		term_flush();
+	if (term->send_pos && term->send_n + n > term->send_sz) {
+		memmove(term->send, term->send + term->send_pos, term->send_n - term->send_pos);
+		term->send_n -= term->send_pos;
+		term->send_pos = 0;
 	}
+	if (term->send_n + n > term->send_sz) {
+		int sz = MAX(term->send_sz * 2, MAX(term->send_n + n, 256));
+		char *send = realloc(term->send, sz);
+		if (!send)
+			return;
+		term->send = send;
+		term->send_sz = sz;
+	}
+	memcpy(term->send + term->send_n, s, n);
+	term->send_n += n;
+	term_flush(term);
 }
 
 static void term_sendstr(char *s)
@@ -454,29 +819,37 @@ static void term_sendstr(char *s)
 static void term_blank(void)
 {
 	screen_reset(0, rows * cols);
-	if (visible)
-		pad_fill(0, -1, 0, -1, clrmap(FN_BG(color())));
+	if (visible && !term->sync)
+		pad_fill(0, -1, 0, -1, clrmap(AT_BG(term, color())));
 }
 
 static int ctlseq(void);
-void term_read(void)
+/* read and interpret about budget bytes; returns the number of bytes read */
+int term_read(int budget)
 {
 	if (!term || !term->fd)
-		return;
-	do {
-		if (ctlseq()) {
-			pty_back();
-			break;
-		}
+		return 0;
+	ptyrem = budget;
+	pty_deadline(PTYUS);
+	while (!ctlseq()) {
 		pty_mark();
 		if (visible && !lazy && pty_left() > 15)
 			lazy_start();
-	} while (pty_left() > 0);
-	lazy_flush();
+	}
+	pty_back();
+	/* synchronized output is drawn when the application ends it or on timeout */
+	if (term->sync && term_ms() >= term->sync)
+		term->sync = 0;
+	if (!term->sync)
+		lazy_flush();
+	return budget - ptyrem;
 }
 
 static void term_reset(void)
 {
+	if (term->alt)
+		alt_swap(term);
+	term->sync = 0;
 	row = col = 0;
 	top = 0;
 	bot = rows;
@@ -582,7 +955,8 @@ void term_exec(char **args, int swsig)
 	fcntl(term->fd, F_SETFD, fcntl(term->fd, F_GETFD) | FD_CLOEXEC);
 	fcntl(term->fd, F_SETFL, fcntl(term->fd, F_GETFL) | O_NONBLOCK);
 	term_reset();
-	memset(term->hist, 0, NHIST * cols * sizeof(term->hist[0]));
+	if (term->hist)
+		memset(term->hist, 0, NHIST * term->mcols * sizeof(term->hist[0]));
 }
 
 static void misc_save(struct term_state *state)
@@ -615,6 +989,44 @@ void term_save(struct term *term)
 	term->recv_n = pty_save(term->recv, sizeof(term->recv));
 }
 
+/* prerender the glyphs of n cells of term's screen from pos; returns the next cell or -1 */
+int term_warm(struct term *t, int pos, int n)
+{
+	int end = t->rows * t->cols;
+	for (; pos < end && n > 0; pos++, n--) {
+		int fn = AT_FN(t, t->scrfn[pos]);
+		if (t->scrch[pos] > ' ')
+			pad_warm(t->scrch[pos], FN_M(fn) | clrmap(FN_FG(fn)), clrmap(AT_BG(t, t->scrfn[pos])));
+	}
+	return pos < end ? pos : -1;
+}
+
+/* milliseconds until the synchronized output of t is drawn or -1 */
+int term_sync(struct term *t)
+{
+	return t->sync ? MAX(0, t->sync - term_ms()) : -1;
+}
+
+/* allocated bytes */
+long term_mem(struct term *t)
+{
+	long mem = sizeof(*t) + t->send_sz + t->mem_sz + t->str_sz;
+	mem += img_sixmem(t->six);
+	if (t->altmem)
+		mem += ALT_SZ(t);
+	mem += t->attr_sz * 2 * (sizeof(t->attr[0]) + sizeof(t->attr_idx[0]));
+	return mem;
+}
+
+/* free the scrolling history and the inactive alternate screen of a hidden terminal */
+void term_trim(struct term *t)
+{
+	if (t != term && !t->hpos)
+		ar_hist(t, 0);
+	if (t != term && !t->alt)
+		alt_free(t);
+}
+
 void term_hide(struct term *term)
 {
 	if (term->pid > 0 && term->signal)
@@ -633,10 +1045,13 @@ void term_signal(struct term *term)
 }
 
 /* redraw the screen; if all is zero, update changed lines only */
+/* + this ends synchronized output */
 void term_redraw(int all)
 {
-	if (term)
+	if (term) {
+		term->sync = 0;
 		term_resizeupdate();
+	}
 	if (term && term->fd) {
 		if (all) {
 			pad_fill(rows, -1, 0, -1, conf_bg());
@@ -739,14 +1154,46 @@ static void blank_rows(int sr, int er)
 	draw_cursor(1);
 }
 
-#define HISTROW(pos)	(term->hist + ((term->hrow + NHIST - (pos)) % NHIST) * cols)
+/* switch to the alternate screen or back; only changed cells are drawn */
+/* + clear: clear the alternate screen before entering or after leaving it */
+static void screen_alt(int set, int clear)
+{
+	int *ch = term->scrch;
+	unsigned short *fn = term->scrfn;
+	int a = attr_get(fg, bg);
+	int i;
+	if (!set == !term->alt || (!term->altmem && alt_alloc(term)))
+		return;
+	if (clear && set) {
+		memset(term->altch, 0, rows * cols * sizeof(term->altch[0]));
+		for (i = 0; i < rows * cols; i++)
+			term->altfn[i] = a;
+	}
+	draw_cursor(0);
+	alt_swap(term);
+	for (i = 0; i < rows * cols; i++)
+		if ((term->scrch[i] != ch[i] || term->scrfn[i] != fn[i]) &&
+				candraw(i / cols, i / cols + 1))
+			_draw_pos(i / cols, i % cols, 0);
+	if (clear && !set) {
+		memset(ch, 0, rows * cols * sizeof(ch[0]));
+		for (i = 0; i < rows * cols; i++)
+			fn[i] = a;
+	}
+	draw_cursor(1);
+}
+
+#define HISTROW(pos)	(term->hist + ((term->hrow + NHIST - (pos)) % NHIST) * term->mcols)
 
 static void scrl_rows(int nr)
 {
 	int i;
+	if (ar_hist(term, NHIST))
+		return;
 	for (i = 0; i < nr; i++) {
 		memcpy(HISTROW(0), term->scrch + i * cols,
 				cols * sizeof(term->scrch[0]));
+		memset(HISTROW(0) + cols, 0, (term->mcols - cols) * sizeof(term->hist[0]));
 		term->hrow = (term->hrow + 1) % NHIST;
 	}
 }
@@ -756,7 +1203,7 @@ void term_scrl(int scrl)
 	int hpos, i, j;
 	if (!term)
 		return;
-	hpos = LIMIT(term->hpos + scrl, 0, NHIST);
+	hpos = LIMIT(term->hpos + scrl, 0, term->hist ? NHIST : 0);
 	term->hpos = hpos;
 	if (!hpos) {
 		lazy_flush();
@@ -767,10 +1214,14 @@ void term_scrl(int scrl)
 	for (i = 0; i < rows; i++) {
 		int off = (i - hpos) * cols;
 		int *_scr = i < hpos ? HISTROW(hpos - i) : term->scrch + off;
-		int *_clr = i < hpos ? NULL : term->scrfn + off;
+		unsigned short *_clr = i < hpos ? NULL : term->scrfn + off;
 		for (j = 0; j < cols; j++) {
-			int c = _clr ? _clr[j] : FN_MK(XG_BG, XG_FG);
-			pad_put(_scr[j], i, j, FN_M(c) | clrmap(FN_FG(c)), clrmap(FN_BG(c)));
+			int fn = _clr ? AT_FN(term, _clr[j]) : XG_BG;
+			int bg = _clr ? AT_BG(term, _clr[j]) : XG_FG;
+			if (_scr[j] & IMGCHAR)
+				img_cell(_scr[j], i, j, clrmap(bg));
+			else
+				pad_put(_scr[j], i, j, FN_M(fn) | clrmap(FN_FG(fn)), clrmap(bg));
 		}
 	}
 }
@@ -778,7 +1229,7 @@ void term_scrl(int scrl)
 static void scroll_screen(int sr, int nr, int n)
 {
 	draw_cursor(0);
-	if (sr + n == 0)
+	if (sr + n == 0 && !term->alt)
 		scrl_rows(sr);
 	screen_move(OFFSET(sr + n, 0), OFFSET(sr, 0), nr * cols);
 	if (n > 0)
@@ -904,6 +1355,95 @@ static void insert_chars(int n)
 	move_chars(col, nc, n);
 }
 
+/* fill the rectangle of rows sr to er and columns sc to ec with ch */
+static void rect_fill(int sr, int er, int sc, int ec, int ch)
+{
+	int a = ch ? color() : attr_get(fg, bg);
+	int i, j;
+	for (i = sr; i < er; i++) {
+		for (j = sc; j < ec; j++) {
+			term->scrch[OFFSET(i, j)] = ch;
+			term->scrfn[OFFSET(i, j)] = a;
+		}
+	}
+	if (candraw(sr, er)) {
+		if (ch && ch != ' ')
+			for (i = sr; i < er; i++)
+				for (j = sc; j < ec; j++)
+					_draw_pos(i, j, 0);
+		else
+			pad_fill(sr, er, sc, ec, clrmap(AT_BG(term, a)));
+	}
+	draw_cursor(1);
+}
+
+/* copy the rectangle of rows sr to er and columns sc to ec to row dr and column dc */
+static void rect_copy(int sr, int er, int sc, int ec, int dr, int dc)
+{
+	int nr = MIN(er - sr, rows - dr);
+	int nc = MIN(ec - sc, cols - dc);
+	int i, j;
+	if (nr <= 0 || nc <= 0)
+		return;
+	draw_cursor(0);
+	for (j = 0; j < nr; j++) {
+		i = dr > sr ? nr - 1 - j : j;
+		memmove(term->scrch + OFFSET(dr + i, dc), term->scrch + OFFSET(sr + i, sc),
+			nc * sizeof(term->scrch[0]));
+		memmove(term->scrfn + OFFSET(dr + i, dc), term->scrfn + OFFSET(sr + i, sc),
+			nc * sizeof(term->scrfn[0]));
+	}
+	if (candraw(dr, dr + nr))
+		pad_copy(sr, sr + nr, sc, sc + nc, dr, dc);
+	draw_cursor(1);
+}
+
+static void advance(int dr, int dc, int scrl);
+
+static void insertchar(int c);
+
+static void printchar(int c)
+{
+	if (isdw(c) && col + 1 == cols && ~mode & MODE_WRAPREADY)
+		insertchar(0);
+	if (!iszw(c))
+		insertchar(c);
+	if (isdw(c))
+		insertchar(c | DWCHAR);
+	term->lastch = c;
+}
+
+/* print the last character n times; narrow characters fill rows at once */
+static void repeatchar(int n)
+{
+	int c = term->lastch;
+	int a, i, k;
+	if (!c || isdw(c) || iszw(c) || mode & MODE_INSERT) {
+		while (c && n-- > 0)
+			printchar(c);
+		return;
+	}
+	while (n > 0) {
+		if (mode & MODE_WRAPREADY)
+			advance(1, -col, 1);
+		/* scrolling may compact the attributes and renumber them */
+		a = color();
+		k = MIN(n, cols - col);
+		for (i = 0; i < k; i++) {
+			term->scrch[OFFSET(row, col + i)] = c;
+			term->scrfn[OFFSET(row, col + i)] = a;
+		}
+		draw_cols(row, col, col + k);
+		n -= k;
+		if (col + k == cols) {
+			move_cursor(row, cols - 1);
+			mode = BIT_SET(mode, MODE_WRAPREADY, 1);
+		} else {
+			advance(0, k, 1);
+		}
+	}
+}
+
 static void advance(int dr, int dc, int scrl)
 {
 	int r = row + dr;
@@ -951,6 +1491,7 @@ static int escseq_osc(void);
 static int csiseq(void);
 static int csiseq_da(int c);
 static int csiseq_dsr(int c);
+static int csiseq_rqm(int priv, int c);
 static int modeseq(int c, int set);
 
 /* comments taken from: http://www.ivarch.com/programs/termvt102.shtml */
@@ -960,24 +1501,33 @@ static int readutf8(int c)
 	int c1, c2, c3;
 	if (~c & 0xc0)		/* ASCII or invalid */
 		return c;
-	c1 = pty_read();
+	/* -1 if the character is not read completely; it is read again later */
+	if ((c1 = pty_read()) < 0)
+		return -1;
 	if (~c & 0x20)
 		return ((c & 0x1f) << 6) | (c1 & 0x3f);
-	c2 = pty_read();
+	if ((c2 = pty_read()) < 0)
+		return -1;
 	if (~c & 0x10)
 		return ((c & 0x0f) << 12) | ((c1 & 0x3f) << 6) | (c2 & 0x3f);
-	c3 = pty_read();
+	if ((c3 = pty_read()) < 0)
+		return -1;
 	if (~c & 0x08)
 		return ((c & 0x07) << 18) | ((c1 & 0x3f) << 12) | ((c2 & 0x3f) << 6) | (c3 & 0x3f);
-	return c1 < 0 || c2 < 0 || c3 < 0 ? -1 : c;
+	return c;
 }
 
 #define unknown(ctl, c)
 
 /* control sequences */
+static int strseq(void);
+
 static int ctlseq(void)
 {
-	int c = pty_read();
+	int c;
+	if (term->str_kind)
+		return strseq();
+	c = pty_read();
 	if (c < 0)
 		return 1;
 	switch (c) {
@@ -1015,12 +1565,7 @@ static int ctlseq(void)
 	default:
 		if ((c = readutf8(c)) < 0)
 			return 1;
-		if (isdw(c) && col + 1 == cols && ~mode & MODE_WRAPREADY)
-			insertchar(0);
-		if (!iszw(c))
-			insertchar(c);
-		if (isdw(c))
-			insertchar(c | DWCHAR);
+		printchar(c);
 	}
 	return 0;
 }
@@ -1069,6 +1614,15 @@ static int escseq(void)
 	case 'c':	/* RIS		reset */
 		term_reset();
 		return 0;
+	case 'P':	/* DCS		device control string (ended by ST) */
+		term->str_kind = c;
+		term->str_n = 0;
+		term->str_more = 0;
+		return 0;
+	case '_':	/* APC		application program command (ended by ST) */
+		term->str_kind = c;
+		term->str_n = term->str_more;
+		return 0;
 	case 'H':	/* HTS		set tab stop at current column */
 	case 'Z':	/* DECID	DEC private ID; return ESC [ ? 6 c (VT102) */
 	case '#':	/* DECALN	("#8") DEC alignment test - fill screen with E's */
@@ -1076,10 +1630,8 @@ static int escseq(void)
 	case '=':	/* DECPAM	set application keypad mode */
 	case 'N':	/* SS2		select G2 charset for next char only */
 	case 'O':	/* SS3		select G3 charset for next char only */
-	case 'P':	/* DCS		device control string (ended by ST) */
 	case 'X':	/* SOS		start of string */
 	case '^':	/* PM		privacy message (ended by ST) */
-	case '_':	/* APC		application program command (ended by ST) */
 	case '\\':	/* ST		string terminator */
 	case 'n':	/* LS2		invoke G2 charset */
 	case 'o':	/* LS3		invoke G3 charset */
@@ -1093,6 +1645,232 @@ static int escseq(void)
 	return 0;
 }
 
+/* device control strings and application program commands */
+
+#define STRMAX		(16 << 20)	/* the maximum length of DCS and APC strings */
+#define STRKEEP		(1 << 16)	/* larger str[] buffers are freed after use */
+#define STREND(c)	((c) == 0x1b || (c) == 0x18 || (c) == 0x1a)
+
+static void str_add(char *s, int n)
+{
+	int sz = MAX(4096, term->str_sz);
+	char *str;
+	if (term->str_n < 0)
+		return;
+	if (term->str_n + n > STRMAX) {
+		term->str_n = -1;
+		return;
+	}
+	while (sz < term->str_n + n)
+		sz *= 2;
+	if (sz > term->str_sz) {
+		if (!(str = realloc(term->str, sz))) {
+			term->str_n = -1;
+			return;
+		}
+		term->str = str;
+		term->str_sz = sz;
+	}
+	memcpy(term->str + term->str_n, s, n);
+	term->str_n += n;
+}
+
+/* show image id at the cursor */
+/* + mv: 0 keeps the cursor, 1 moves it to the next line, 2 after the image */
+static void img_put(int id, int mv)
+{
+	int r = row, c = col;
+	int a, w, h, nr, nc;
+	int i, j;
+	if (id < 0 || img_size(id, &w, &h))
+		return;
+	nr = MIN(1024, (h + pad_crows() - 1) / pad_crows());
+	nc = MIN(1024, (w + pad_ccols() - 1) / pad_ccols());
+	for (i = 0; i < nr; i++) {
+		if (i)
+			advance(1, 0, 1);
+		a = color();
+		for (j = 0; j < nc && col + j < cols; j++) {
+			term->scrch[OFFSET(row, col + j)] = IMG_CELL(id, i, j);
+			term->scrfn[OFFSET(row, col + j)] = a;
+		}
+		draw_cols(row, col, MIN(cols, col + nc));
+	}
+	if (mv == 0)
+		move_cursor(r, c);
+	if (mv == 1)
+		advance(1, 0, 1);
+	if (mv == 2)
+		advance(0, nc, 1);
+}
+
+/* erase the cells of image id or, if id is negative, of all images */
+/* + drop: free the erased images too */
+static void img_del(int id, int drop)
+{
+	int i;
+	for (i = 0; i < rows * cols; i++) {
+		int ch = term->scrch[i];
+		if ((ch & IMGCHAR) && (id < 0 || IMG_ID(ch) == id)) {
+			term->scrch[i] = 0;
+			draw_char(0, i / cols, i % cols);
+			if (drop)
+				img_drop(IMG_ID(ch));
+		}
+	}
+	if (drop && id >= 0)
+		img_drop(id);
+}
+
+/* when image ids run out, find the ones no longer in any screen or history */
+static void img_sweep(void)
+{
+	struct term *t;
+	long i;
+	if (!img_full())
+		return;
+	img_unref();
+	for (t = term_all; t; t = t->next) {
+		for (i = 0; i < t->rows * t->cols; i++) {
+			if (t->scrch[i] & IMGCHAR)
+				img_ref(t->scrch[i]);
+			if (t->altch && t->altch[i] & IMGCHAR)
+				img_ref(t->altch[i]);
+		}
+		for (i = 0; t->hist && i < NHIST * t->mcols; i++)
+			if (t->hist[i] & IMGCHAR)
+				img_ref(t->hist[i]);
+	}
+}
+
+/* kitty graphics protocol: ESC _ G control-data ; base64-payload ESC \ */
+/* + images sent in chunks (m=1) are collected in str[] after the first one */
+static void kittyseq(void)
+{
+	char *beg = term->str + term->str_more;
+	char *end = term->str + term->str_n;
+	char *s = memchr(beg, ';', end - beg);
+	char ctl[256], status[256];
+	char *data, *err = NULL;
+	int act, kid, quiet, del, len;
+	int id = -1;
+	snprintf(ctl, sizeof(ctl), "%.*s", (int) ((s ? s : end) - beg - 1), beg + 1);
+	if (term->str_more) {		/* append the payload to the previous chunks */
+		len = s ? end - s - 1 : 0;
+		if (len)
+			memmove(beg, s + 1, len);
+		term->str_n = term->str_more + len;
+	}
+	if (img_key(ctl, 'm', 0) == 1) {
+		if (!term->str_more && !s)
+			str_add(";", 1);
+		term->str_more = MAX(0, term->str_n);
+		return;
+	}
+	term->str_more = 0;
+	s = memchr(term->str, ';', term->str_n);
+	end = term->str + term->str_n;
+	snprintf(ctl, sizeof(ctl), "%.*s", (int) ((s ? s : end) - term->str - 1), term->str + 1);
+	data = s ? s + 1 : end;
+	len = img_b64(data, data, end - data);
+	act = img_key(ctl, 'a', 't');
+	kid = img_key(ctl, 'i', 0);
+	quiet = img_key(ctl, 'q', 0);
+	del = img_key(ctl, 'd', 'a');
+	switch (act) {
+	case 't':	/* transmit */
+	case 'T':	/* transmit and display */
+	case 'q':	/* query */
+		img_sweep();
+		/* queries do not replace the image with the same id */
+		id = img_kitty(ctl, data, len, clrmap(AT_BG(term, color())),
+			act == 'q' ? 0 : kid, &err);
+		break;
+	case 'p':	/* display */
+		if ((id = img_kid(kid)) < 0)
+			err = "ENOENT:no such image";
+		break;
+	case 'd':	/* delete all images (a) or image i (i); others are ignored */
+		if (del == 'a' || del == 'A')
+			img_del(-1, del == 'A');
+		if ((del == 'i' || del == 'I') && (id = img_kid(kid)) >= 0)
+			img_del(id, del == 'I');
+		return;
+	default:
+		err = "EINVAL:unsupported action";
+	}
+	if (id >= 0 && (act == 'T' || act == 'p'))
+		img_put(id, img_key(ctl, 'C', 0) == 1 ? 0 : 2);
+	if (act == 'q')
+		img_drop(id);
+	if (kid && quiet < (err ? 2 : 1)) {
+		snprintf(status, sizeof(status), "\x1b_Gi=%d;%s\x1b\\", kid, err ? err : "OK");
+		term_sendstr(status);
+	}
+}
+
+/* start decoding a sixel image if str[] holds its parameters and q */
+static void str_six(void)
+{
+	char *s = term->str;
+	char *e = s + MAX(0, term->str_n);
+	while (s < e && (isdigit((unsigned char) *s) || *s == ';'))
+		s++;
+	if (s == e || *s != 'q')
+		return;
+	if ((term->six = img_sixbeg(clrmap(AT_BG(term, color())))))
+		img_sixput(term->six, s + 1, e - s - 1);
+	term->str_n = -1;
+}
+
+static void str_end(int ok)
+{
+	if (term->six && ok) {	/* sixel image */
+		img_sweep();
+		img_put(img_sixend(term->six), 1);
+	} else {
+		img_sixfree(term->six);
+	}
+	term->six = NULL;
+	if (term->str_kind == '_' && ok && term->str_n > term->str_more &&
+			term->str[term->str_more] == 'G')
+		kittyseq();
+	else
+		term->str_more = 0;
+	if (term->str_sz > STRKEEP && !term->str_more) {
+		free(term->str);
+		term->str = NULL;
+		term->str_sz = 0;
+	}
+	term->str_kind = 0;
+	term->str_n = 0;
+}
+
+/* receive DCS strings; bytes are consumed as they arrive, up to ST */
+static int strseq(void)
+{
+	int c = pty_read();
+	int beg = ptycur - 1;
+	if (c < 0)
+		return 1;
+	if (STREND(c)) {
+		if (c == 0x1b)		/* ST (ESC \) or another sequence */
+			ptycur--;
+		str_end(c == 0x1b);
+		return 0;
+	}
+	while (ptycur < ptylen && !STREND(ptybuf[ptycur]))
+		ptycur++;
+	if (term->six) {	/* sixel images are decoded as they arrive */
+		img_sixput(term->six, ptybuf + beg, ptycur - beg);
+		return 0;
+	}
+	str_add(ptybuf + beg, ptycur - beg);
+	if (term->str_kind == 'P' && term->str_n > 0)
+		str_six();
+	return 0;
+}
+
 static int escseq_cs(void)
 {
 	int c = pty_read();
@@ -1179,6 +1957,8 @@ static int escseq_osc(void)
 	int c = pty_read();
 	int osc = 0;
 	int i;
+	if (c < 0)
+		return 1;
 	if (!isdigit(c))
 		return 0;
 	while (isdigit(c)) {
@@ -1210,6 +1990,17 @@ static int absrow(int r)
 #define CSIF(c)			((c) >= 0x40 && (c) < 0x80)
 
 #define MAXCSIARGS	32
+
+/* the rectangle of DEC rectangular operations: top, left, bottom, right */
+static int csirect(int *args, int *sr, int *sc, int *er, int *ec)
+{
+	*sr = MIN(absrow(MAX(1, args[0]) - 1), rows);
+	*sc = MIN(MAX(1, args[1]) - 1, cols);
+	*er = MIN(args[2] ? absrow(args[2] - 1) + 1 : (origin() ? bot : rows), rows);
+	*ec = MIN(args[3] ? args[3] : cols, cols);
+	return *sr >= *er || *sc >= *ec;
+}
+
 /* ECMA-48 CSI sequences */
 static int csiseq(void)
 {
@@ -1218,6 +2009,8 @@ static int csiseq(void)
 	int n = 0;
 	int c = pty_read();
 	int priv = 0;
+	int inter = 0;
+	int sr, sc, er, ec;
 
 	if (c >= 0 && strchr("<=>?", c)) {
 		priv = c;
@@ -1234,8 +2027,10 @@ static int csiseq(void)
 		if (n < MAXCSIARGS)
 			args[n++] = arg;
 	}
-	while (CSII(c))
+	while (CSII(c)) {
+		inter = c;
 		c = pty_read();
+	}
 	if (c < 0)
 		return 1;
 	switch (c) {
@@ -1343,13 +2138,16 @@ static int csiseq(void)
 		csiseq_da(priv == '?' ? args[0] | 0x80 : args[0]);
 		break;
 	case 'h':	/* SM		set mode */
+		/* 0x80 marks DEC private modes; ANSI modes with this bit are ignored */
 		for (i = 0; i < n; i++)
-			modeseq(priv == '?' ? args[i] | 0x80 : args[i], 1);
+			if (priv == '?' || ~args[i] & 0x80)
+				modeseq(priv == '?' ? args[i] | 0x80 : args[i], 1);
 		draw_cursor(1);
 		break;
 	case 'l':	/* RM		reset mode */
 		for (i = 0; i < n; i++)
-			modeseq(priv == '?' ? args[i] | 0x80 : args[i], 0);
+			if (priv == '?' || ~args[i] & 0x80)
+				modeseq(priv == '?' ? args[i] | 0x80 : args[i], 0);
 		draw_cursor(1);
 		break;
 	case 'P':	/* DCH		delete characters on current line */
@@ -1367,14 +2165,41 @@ static int csiseq(void)
 	case 'X':	/* ECH		erase characters on current line */
 		kill_chars(col, MIN(col + MAX(1, args[0]), cols));
 		break;
-	case '[':	/* IGN		ignored control sequence */
+	case 'p':	/* DECRQM	request mode ("$p") */
+		if (inter == '$')
+			csiseq_rqm(priv, args[0]);
+		break;
+	case 'b':	/* REP		repeat the preceding character */
+		repeatchar(LIMIT(args[0], 1, rows * cols));
+		break;
 	case 'E':	/* CNL		move cursor down and to column 1 */
+		advance(MAX(1, args[0]), -col, 0);
+		break;
 	case 'F':	/* CPL		move cursor up and to column 1 */
+		advance(-MAX(1, args[0]), -col, 0);
+		break;
+	case '`':	/* HPA		move cursor to column in current row */
+		advance(0, MAX(0, args[0] - 1) - col, 0);
+		break;
+	case 'x':	/* DECFRA	fill rectangle ("$x") */
+		if (inter == '$' && (args[0] >= 32 && args[0] != 127) &&
+				!csirect(args + 1, &sr, &sc, &er, &ec))
+			rect_fill(sr, er, sc, ec, args[0]);
+		break;
+	case 'z':	/* DECERA	erase rectangle ("$z") */
+		if (inter == '$' && !csirect(args, &sr, &sc, &er, &ec))
+			rect_fill(sr, er, sc, ec, 0);
+		break;
+	case 'v':	/* DECCRA	copy rectangle ("$v"); pages are ignored */
+		if (inter == '$' && !csirect(args, &sr, &sc, &er, &ec))
+			rect_copy(sr, er, sc, ec, absrow(MAX(1, args[5]) - 1),
+				MAX(1, args[6]) - 1);
+		break;
+	case '[':	/* IGN		ignored control sequence */
 	case 'g':	/* TBC		clear tab stop (CSI 3 g = clear all stops) */
 	case 'q':	/* DECLL	set keyboard LEDs */
 	case 's':	/* CUPSV	save cursor position */
 	case 'u':	/* CUPRS	restore cursor position */
-	case '`':	/* HPA		move cursor to column in current row */
 	default:
 		unknown("csiseq", c);
 	}
@@ -1393,6 +2218,40 @@ static int csiseq_da(int c)
 	return 0;
 }
 
+/* report whether mode c is set */
+static int csiseq_rqm(int priv, int c)
+{
+	char status[64];
+	int m = c | 0x80;
+	int set = 0;		/* 0: unknown, 1: set, 2: reset */
+	if (priv == '?') {
+		switch (m) {
+		case 0x87:
+			set = mode & MODE_WRAP ? 1 : 2;
+			break;
+		case 0x99:
+			set = mode & MODE_CURSOR ? 1 : 2;
+			break;
+		case 0x86:
+			set = mode & MODE_ORIGIN ? 1 : 2;
+			break;
+		case 0xaf:
+		case 0x497:
+		case 0x499:
+			set = term->alt ? 1 : 2;
+			break;
+		case 0x7ea:
+			set = term->sync ? 1 : 2;
+			break;
+		}
+	} else if (!priv && (c == 4 || c == 20)) {
+		set = mode & (c == 4 ? MODE_INSERT : MODE_AUTOCR) ? 1 : 2;
+	}
+	sprintf(status, "\x1b[%s%d;%d$y", priv == '?' ? "?" : "", c, set);
+	term_sendstr(status);
+	return 0;
+}
+
 static int csiseq_dsr(int c)
 {
 	char status[1 << 5];
@@ -1430,6 +2289,31 @@ static int modeseq(int c, int set)
 	case 0x04:	/* IRM		insertion/replacement mode (always reset) */
 		mode = BIT_SET(mode, MODE_INSERT, set);
 		break;
+	case 0x7ea:	/* SYNC		hold back drawing until reset (synchronized output) */
+		term->sync = set ? term_ms() + SYNCMS : 0;
+		if (set && !lazy)
+			lazy_start();
+		break;
+	case 0xaf:	/* ALTBUF	alternate screen (set); normal screen (reset) */
+		screen_alt(set, 0);
+		break;
+	case 0x497:	/* ALTBUF	like 47, but clear the alternate screen when leaving it */
+		screen_alt(set, !set);
+		break;
+	case 0x499:	/* ALTBUF	like 47, but save the cursor and clear the alternate screen */
+		if (set && !term->alt)
+			misc_save(&term->sav);
+		if (!set == !term->alt)
+			break;
+		screen_alt(set, 1);
+		if (!set && !term->alt) {
+			draw_cursor(0);
+			misc_load(&term->sav);
+			row = MIN(row, rows - 1);
+			col = MIN(col, cols - 1);
+			draw_cursor(1);
+		}
+		break;
 	case 0x00:	/* IGN		error (ignored) */
 	case 0x01:	/* GATM		guarded-area transfer mode (ignored) */
 	case 0x02:	/* KAM		keyboard action mode (always reset) */